@@ -0,0 +1,303 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "thread.h"
+
+// A thread sleeping in a send or a receive, on its own stack
+typedef struct waiter {
+	struct waiter* next;
+	struct thread_parker parker;
+} waiter;
+
+typedef struct waitList {
+	waiter* head;
+	waiter* tail;
+} waitList;
+
+// Items sit in a ring buffer, oldest at `head`. Blocked senders and receivers
+// queue up in FIFO order, but a thread that finds room (or items) goes ahead of
+// them, as with SEM_BARGING semaphores. At most one sender and one receiver
+// are woken at a time: each woken thread wakes the next one when it is done,
+// if there is still room (or items) left for it. Closing the channel wakes
+// every blocked thread at once.
+struct channel {
+	pthread_mutex_t lock;
+	void** items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	waitList senders;
+	waitList receivers;
+	// Number of woken threads that have yet to take the lock again
+	int senderWoken;
+	int receiverWoken;
+	int closed;
+};
+
+static void pushBack(waitList* list, waiter* w)
+{
+	w->next = NULL;
+	if (list->tail != NULL)
+		list->tail->next = w;
+	else
+		list->head = w;
+	list->tail = w;
+}
+
+static void pushFront(waitList* list, waiter* w)
+{
+	w->next = list->head;
+	list->head = w;
+	if (list->tail == NULL)
+		list->tail = w;
+}
+
+static waiter* popFront(waitList* list)
+{
+	waiter* w = list->head;
+	list->head = w->next;
+	if (list->head == NULL)
+		list->tail = NULL;
+	return w;
+}
+
+static size_t min(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+// Append @n items, for which there is room, in at most two copies
+static void copyIn(channel_t channel, void* const* items, size_t n)
+{
+	size_t tail = (channel->head + channel->count) % channel->capacity;
+	size_t first = min(n, channel->capacity - tail);
+	memcpy(channel->items + tail, items, first * sizeof(void*));
+	memcpy(channel->items, items + first, (n - first) * sizeof(void*));
+	channel->count += n;
+}
+
+// Take the @n oldest items, which are there, in at most two copies
+static void copyOut(channel_t channel, void** items, size_t n)
+{
+	size_t first = min(n, channel->capacity - channel->head);
+	memcpy(items, channel->items + channel->head, first * sizeof(void*));
+	memcpy(items + first, channel->items, (n - first) * sizeof(void*));
+	channel->head = (channel->head + n) % channel->capacity;
+	channel->count -= n;
+}
+
+// Under the lock, take out the sender and the receiver (if any) that can go
+// now, to be woken once the lock is dropped
+static void pickWakes(channel_t channel, waiter** wakes)
+{
+	wakes[0] = wakes[1] = NULL;
+	if (channel->count < channel->capacity && !channel->senderWoken && channel->senders.head != NULL) {
+		wakes[0] = popFront(&channel->senders);
+		channel->senderWoken++;
+	}
+	if (channel->count > 0 && !channel->receiverWoken && channel->receivers.head != NULL) {
+		wakes[1] = popFront(&channel->receivers);
+		channel->receiverWoken++;
+	}
+}
+
+static void unparkAll(waiter** wakes)
+{
+	for (int i = 0; i < 2; i++)
+		if (wakes[i] != NULL)
+			thread_unpark(&wakes[i]->parker);
+}
+
+static void unlockAndWake(channel_t channel)
+{
+	waiter* wakes[2];
+	pickWakes(channel, wakes);
+	pthread_mutex_unlock(&channel->lock);
+	unparkAll(wakes);
+}
+
+// Sleep on @list, with the channel's lock dropped, until woken. A thread that
+// was woken but found nothing left for it goes back to the front of the list.
+static void sleepOn(channel_t channel, waitList* list, int* woken, int again)
+{
+	waiter self;
+	thread_parker_init(&self.parker);
+	if (again)
+		pushFront(list, &self);
+	else
+		pushBack(list, &self);
+
+	// Whatever we did so far may let threads of the other side go
+	waiter* wakes[2];
+	pickWakes(channel, wakes);
+	pthread_mutex_unlock(&channel->lock);
+	unparkAll(wakes);
+
+	thread_park(&self.parker);
+	pthread_mutex_lock(&channel->lock);
+	(*woken)--;
+}
+
+// Under the lock, take out every thread of @list to be woken, and count them
+// in @woken
+static waiter* takeAll(waitList* list, int* woken)
+{
+	waiter* all = list->head;
+	for (waiter* w = all; w != NULL; w = w->next)
+		(*woken)++;
+	list->head = list->tail = NULL;
+	return all;
+}
+
+// Wake up the threads taken out by takeAll(), with the lock dropped. A woken
+// thread may be gone at once, so we are done with it by then.
+static void unparkList(waiter* w)
+{
+	while (w != NULL) {
+		waiter* next = w->next;
+		thread_unpark(&w->parker);
+		w = next;
+	}
+}
+
+channel_t channel_create(size_t capacity)
+{
+	if (capacity == 0) return NULL;
+
+	channel_t channel = malloc(sizeof(struct channel));
+	if (channel == NULL) return NULL;
+	channel->items = malloc(capacity * sizeof(void*));
+	if (channel->items == NULL) {
+		free(channel);
+		return NULL;
+	}
+
+	pthread_mutex_init(&channel->lock, NULL);
+	channel->capacity = capacity;
+	channel->head = 0;
+	channel->count = 0;
+	channel->senders.head = channel->senders.tail = NULL;
+	channel->receivers.head = channel->receivers.tail = NULL;
+	channel->senderWoken = 0;
+	channel->receiverWoken = 0;
+	channel->closed = 0;
+	return channel;
+}
+
+int channel_destroy(channel_t channel)
+{
+	if (channel == NULL) return -1;
+
+	pthread_mutex_lock(&channel->lock);
+	int busy = channel->senders.head != NULL || channel->receivers.head != NULL || channel->senderWoken || channel->receiverWoken;
+	pthread_mutex_unlock(&channel->lock);
+	if (busy) return -1;
+
+	pthread_mutex_destroy(&channel->lock);
+	free(channel->items);
+	free(channel);
+	return 0;
+}
+
+int channel_close(channel_t channel)
+{
+	if (channel == NULL) return -1;
+
+	pthread_mutex_lock(&channel->lock);
+	if (channel->closed) {
+		pthread_mutex_unlock(&channel->lock);
+		return -1;
+	}
+	channel->closed = 1;
+	waiter* senders = takeAll(&channel->senders, &channel->senderWoken);
+	waiter* receivers = takeAll(&channel->receivers, &channel->receiverWoken);
+	pthread_mutex_unlock(&channel->lock);
+	unparkList(senders);
+	unparkList(receivers);
+	return 0;
+}
+
+int channel_send(channel_t channel, void *item)
+{
+	return channel_send_many(channel, &item, 1);
+}
+
+int channel_trysend(channel_t channel, void *item)
+{
+	if (channel == NULL) return -1;
+
+	pthread_mutex_lock(&channel->lock);
+	if (channel->closed || channel->count == channel->capacity) {
+		pthread_mutex_unlock(&channel->lock);
+		return -1;
+	}
+	copyIn(channel, &item, 1);
+	unlockAndWake(channel);
+	return 0;
+}
+
+int channel_send_many(channel_t channel, void *const *items, size_t n)
+{
+	if (channel == NULL || items == NULL) return -1;
+
+	pthread_mutex_lock(&channel->lock);
+	size_t sent = 0;
+	int again = 0;
+	while (1) {
+		if (channel->closed) {
+			unlockAndWake(channel);
+			return -1;
+		}
+		size_t batch = min(n - sent, channel->capacity - channel->count);
+		copyIn(channel, items + sent, batch);
+		sent += batch;
+		if (sent == n) break;
+		sleepOn(channel, &channel->senders, &channel->senderWoken, again);
+		again = 1;
+	}
+	unlockAndWake(channel);
+	return 0;
+}
+
+int channel_recv(channel_t channel, void **item)
+{
+	if (item == NULL) return -1;
+	return channel_recv_many(channel, item, 1) < 0 ? -1 : 0;
+}
+
+int channel_tryrecv(channel_t channel, void **item)
+{
+	if (channel == NULL || item == NULL) return -1;
+
+	pthread_mutex_lock(&channel->lock);
+	if (channel->count == 0) {
+		pthread_mutex_unlock(&channel->lock);
+		return -1;
+	}
+	copyOut(channel, item, 1);
+	unlockAndWake(channel);
+	return 0;
+}
+
+long channel_recv_many(channel_t channel, void **items, size_t n)
+{
+	if (channel == NULL || items == NULL || n == 0) return -1;
+
+	pthread_mutex_lock(&channel->lock);
+	int again = 0;
+	while (channel->count == 0) {
+		if (channel->closed) {
+			pthread_mutex_unlock(&channel->lock);
+			return -1;
+		}
+		sleepOn(channel, &channel->receivers, &channel->receiverWoken, again);
+		again = 1;
+	}
+	size_t batch = min(n, channel->count);
+	copyOut(channel, items, batch);
+	unlockAndWake(channel);
+	return batch;
+}
@@ -0,0 +1,124 @@
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include <stddef.h>
+
+/*
+ * channel_t - Channel type
+ *
+ * A channel is a bounded FIFO of items (any pointer value, NULL included) that
+ * any number of threads send to and receive from. Senders block while the
+ * channel is full and receivers while it is empty. Each send or receive,
+ * including the batch variants, synchronizes once however many items it moves.
+ *
+ * Once closed, a channel takes no more items, but the items already in it can
+ * still be received. Sends then fail, and so do receives once the channel is
+ * empty, including those blocked when the channel was closed.
+ */
+typedef struct channel *channel_t;
+
+/*
+ * channel_create - Create channel
+ * @capacity: Number of items the channel can hold
+ *
+ * Return: Pointer to new empty channel. NULL if @capacity is 0, or in case of
+ * failure when allocating the new channel.
+ */
+channel_t channel_create(size_t capacity);
+
+/*
+ * channel_destroy - Deallocate a channel
+ * @channel: Channel to deallocate
+ *
+ * Deallocate channel @channel. Items still in @channel are dropped without
+ * being freed: whatever they point to remains the caller's responsibility.
+ *
+ * Return: -1 if @channel is NULL or if threads are still blocked sending to or
+ * receiving from @channel. 0 if @channel was successfully destroyed.
+ */
+int channel_destroy(channel_t channel);
+
+/*
+ * channel_close - Close a channel
+ * @channel: Channel to close
+ *
+ * Close channel @channel, and wake up every thread blocked sending to or
+ * receiving from it, which then fails.
+ *
+ * Return: -1 if @channel is NULL or already closed. 0 if @channel was closed.
+ */
+int channel_close(channel_t channel);
+
+/*
+ * channel_send - Send an item
+ * @channel: Channel to send to
+ * @item: Item to send
+ *
+ * Append @item to @channel, blocking while @channel is full.
+ *
+ * Return: -1 if @channel is NULL or closed. 0 once @item was sent.
+ */
+int channel_send(channel_t channel, void *item);
+
+/*
+ * channel_trysend - Send an item without blocking
+ * @channel: Channel to send to
+ * @item: Item to send
+ *
+ * Return: -1 if @channel is NULL, full or closed. 0 if @item was sent.
+ */
+int channel_trysend(channel_t channel, void *item);
+
+/*
+ * channel_send_many - Send several items
+ * @channel: Channel to send to
+ * @items: Items to send
+ * @n: Number of items
+ *
+ * Append the @n items of @items to @channel in order, blocking while @channel
+ * is full. Items are moved as many at a time as there is room for; items of
+ * other senders may come in between two such batches.
+ *
+ * Return: -1 if @channel or @items is NULL, or if @channel is closed before
+ * all items were sent (the batches sent until then stay in @channel). 0 once
+ * all items were sent.
+ */
+int channel_send_many(channel_t channel, void *const *items, size_t n);
+
+/*
+ * channel_recv - Receive an item
+ * @channel: Channel to receive from
+ * @item: Address of data pointer where the item is received
+ *
+ * Take the oldest item of @channel, blocking while @channel is empty.
+ *
+ * Return: -1 if @channel or @item is NULL, or if @channel is empty and closed.
+ * 0 once @item was set.
+ */
+int channel_recv(channel_t channel, void **item);
+
+/*
+ * channel_tryrecv - Receive an item without blocking
+ * @channel: Channel to receive from
+ * @item: Address of data pointer where the item is received
+ *
+ * Return: -1 if @channel or @item is NULL, or if @channel is empty. 0 if @item
+ * was set.
+ */
+int channel_tryrecv(channel_t channel, void **item);
+
+/*
+ * channel_recv_many - Receive several items
+ * @channel: Channel to receive from
+ * @items: Array where the items are received
+ * @n: Maximum number of items to receive
+ *
+ * Take up to @n of the oldest items of @channel at once, blocking while
+ * @channel is empty.
+ *
+ * Return: -1 if @channel or @items is NULL, if @n is 0, or if @channel is empty
+ * and closed. Number of items received otherwise, at least 1.
+ */
+long channel_recv_many(channel_t channel, void **items, size_t n);
+
+#endif /* _CHANNEL_H */
@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "hazard.h"
+
+typedef struct retiredNode {
+	void* node;
+	void (*freeFunc)(void* node);
+} retiredNode;
+
+// Records are only ever pushed onto the shared list, never taken off it, so
+// walking the list is always safe. A record whose thread has exited is idle
+// until another thread claims it.
+typedef struct hazardRecord {
+	void* _Atomic slots[HAZARD_SLOTS];
+	atomic_int active;
+	// Nodes retired through this record and not freed yet
+	retiredNode* retired;
+	size_t count;
+	size_t size;
+	struct hazardRecord* next;
+} hazardRecord;
+
+static hazardRecord* _Atomic records;
+static atomic_size_t recordCount;
+
+static __thread hazardRecord* self;
+// Hands the record back when its thread exits
+static pthread_key_t exitKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+static void releaseRecord(void* arg)
+{
+	hazardRecord* record = arg;
+	for (int i = 0; i < HAZARD_SLOTS; i++)
+		atomic_store(&record->slots[i], NULL);
+	atomic_store(&record->active, 0);
+}
+
+static void createKey(void)
+{
+	pthread_key_create(&exitKey, releaseRecord);
+}
+
+int hazard_register(void)
+{
+	if (self != NULL) return 0;
+	pthread_once(&keyOnce, createKey);
+
+	// Take over an idle record if there is one
+	hazardRecord* record;
+	for (record = atomic_load(&records); record != NULL; record = record->next) {
+		int idle = 0;
+		if (atomic_compare_exchange_strong(&record->active, &idle, 1))
+			break;
+	}
+
+	if (record == NULL) {
+		record = calloc(1, sizeof(hazardRecord));
+		if (record == NULL) return -1;
+		atomic_store(&record->active, 1);
+		record->next = atomic_load(&records);
+		while (!atomic_compare_exchange_weak(&records, &record->next, record))
+			;
+		atomic_fetch_add(&recordCount, 1);
+	}
+
+	pthread_setspecific(exitKey, record);
+	self = record;
+	return 0;
+}
+
+void *hazard_protect(int slot, void *_Atomic *src)
+{
+	void* ptr = atomic_load(src);
+	while (1) {
+		atomic_store(&self->slots[slot], ptr);
+		// Only if @src still holds it was the node not retired before we
+		// published it
+		void* again = atomic_load(src);
+		if (again == ptr) return ptr;
+		ptr = again;
+	}
+}
+
+void hazard_clear(void)
+{
+	for (int i = 0; i < HAZARD_SLOTS; i++)
+		atomic_store(&self->slots[i], NULL);
+}
+
+static int isHazard(void* node)
+{
+	for (hazardRecord* record = atomic_load(&records); record != NULL; record = record->next)
+		for (int i = 0; i < HAZARD_SLOTS; i++)
+			if (atomic_load(&record->slots[i]) == node)
+				return 1;
+	return 0;
+}
+
+// Free the nodes of our record that no thread protects any more
+static void scan(void)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < self->count; i++) {
+		retiredNode* retired = &self->retired[i];
+		if (isHazard(retired->node))
+			self->retired[kept++] = *retired;
+		else
+			retired->freeFunc(retired->node);
+	}
+	self->count = kept;
+}
+
+void hazard_retire(void *node, void (*free_func)(void *node))
+{
+	// Scanning once there are well more retired nodes than slots in all
+	// records frees most of them each time, which keeps retiring O(1)
+	// amortized
+	size_t threshold = 2 * HAZARD_SLOTS * atomic_load(&recordCount) + 16;
+	if (self->count >= threshold)
+		scan();
+
+	while (self->count == self->size) {
+		size_t size = self->size > 0 ? self->size * 2 : 32;
+		retiredNode* retired = realloc(self->retired, size * sizeof(retiredNode));
+		if (retired != NULL) {
+			self->retired = retired;
+			self->size = size;
+			break;
+		}
+		// Out of memory: wait for some of the nodes to be let go of
+		sched_yield();
+		scan();
+	}
+
+	self->retired[self->count].node = node;
+	self->retired[self->count].freeFunc = free_func;
+	self->count++;
+}
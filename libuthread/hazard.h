@@ -0,0 +1,60 @@
+#ifndef _HAZARD_H
+#define _HAZARD_H
+
+#include <stdatomic.h>
+
+/*
+ * Hazard pointers
+ *
+ * Lock-free structures of the library cannot free a node as soon as they
+ * unlink it: another thread may have read its address just before and still be
+ * about to use it. Such a thread first publishes the address in one of its
+ * hazard slots, and unlinked nodes are retired rather than freed. A retired
+ * node is only freed once no thread has it in a hazard slot.
+ *
+ * Each thread gets a record with HAZARD_SLOTS slots when it registers. The
+ * record goes back to a shared list when the thread exits, along with the nodes
+ * it retired but could not free yet, for the next thread to take over.
+ */
+
+#define HAZARD_SLOTS 2
+
+/*
+ * hazard_register - Give the calling thread its hazard record
+ *
+ * Must be called before the thread's first hazard_protect(), and is cheap to
+ * call again.
+ *
+ * Return: -1 in case of failure when allocating a new record. 0 otherwise.
+ */
+int hazard_register(void);
+
+/*
+ * hazard_protect - Protect a shared pointer
+ * @slot: Hazard slot of the calling thread to use, below HAZARD_SLOTS
+ * @src: Shared location to read the pointer from
+ *
+ * Read the pointer stored at @src and publish it in slot @slot, making sure
+ * that @src still held it once published: the node it points to can then not
+ * be freed until the slot is cleared or reused.
+ *
+ * Return: Pointer read from @src.
+ */
+void *hazard_protect(int slot, void *_Atomic *src);
+
+/*
+ * hazard_clear - Clear the calling thread's hazard slots
+ */
+void hazard_clear(void);
+
+/*
+ * hazard_retire - Free a node once it is safe
+ * @node: Node that is no longer reachable from the shared structure
+ * @free_func: Function freeing @node
+ *
+ * Call @free_func(@node) as soon as no thread has @node in a hazard slot,
+ * which may be right away or in a later call.
+ */
+void hazard_retire(void *node, void (*free_func)(void *node));
+
+#endif /* _HAZARD_H */
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "tps.h"
+
+// Number of slots mapped at once when the pool runs dry
+#define POOL_ARENA_SLOTS 256
+
+typedef struct slotStack {
+	void** slots;
+	size_t count;
+	size_t size;
+} slotStack;
+
+// Slots whose pages are not resident: zero-filled by the kernel on first touch
+static slotStack coldSlots;
+// Slots whose pages are resident and already zeroed
+static slotStack warmSlots;
+static size_t warmTarget;
+static size_t totalSlots;
+
+// Both stacks can hold every slot of the pool, so pushing never allocates
+static int growStacks(size_t size)
+{
+	void** cold = realloc(coldSlots.slots, size * sizeof(void*));
+	if (cold == NULL) return -1;
+	coldSlots.slots = cold;
+	coldSlots.size = size;
+
+	void** warm = realloc(warmSlots.slots, size * sizeof(void*));
+	if (warm == NULL) return -1;
+	warmSlots.slots = warm;
+	warmSlots.size = size;
+	return 0;
+}
+
+static int newArena(void)
+{
+	if (growStacks(totalSlots + POOL_ARENA_SLOTS) < 0) return -1;
+
+	char* base = mmap(NULL, POOL_ARENA_SLOTS * TPS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) return -1;
+	totalSlots += POOL_ARENA_SLOTS;
+
+	// Push in reverse so that slots are handed out in address order
+	for (size_t i = POOL_ARENA_SLOTS; i > 0; i--)
+		coldSlots.slots[coldSlots.count++] = base + (i - 1) * TPS_SIZE;
+	return 0;
+}
+
+// Fault the slot's page in and zero it, leaving it PROT_NONE
+static void warmSlot(void* slot)
+{
+	mprotect(slot, TPS_SIZE, PROT_READ | PROT_WRITE);
+	memset(slot, 0, TPS_SIZE);
+	mprotect(slot, TPS_SIZE, PROT_NONE);
+}
+
+void *pool_alloc(void)
+{
+	if (warmSlots.count > 0)
+		return warmSlots.slots[--warmSlots.count];
+	if (coldSlots.count == 0 && newArena() < 0)
+		return NULL;
+	return coldSlots.slots[--coldSlots.count];
+}
+
+void pool_free(void *slot)
+{
+	if (warmSlots.count < warmTarget) {
+		warmSlot(slot);
+		warmSlots.slots[warmSlots.count++] = slot;
+	} else {
+		// MADV_FREE would be cheaper but doesn't guarantee the slot reads back
+		// as zeros, which tps_create() promises
+		madvise(slot, TPS_SIZE, MADV_DONTNEED);
+		coldSlots.slots[coldSlots.count++] = slot;
+	}
+}
+
+void *pool_grow(void *slot, size_t size)
+{
+	void* moved = mremap(slot, TPS_SIZE, size, MREMAP_MAYMOVE);
+	if (moved == MAP_FAILED) return NULL;
+
+	// The slot is now a hole in its arena: map a fresh page back in its place.
+	// Should that fail, the pool simply does without the slot.
+	if (mmap(slot, TPS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED)
+		coldSlots.slots[coldSlots.count++] = slot;
+	return moved;
+}
+
+int pool_reserve(size_t count)
+{
+	if (count > warmTarget)
+		warmTarget = count;
+
+	while (warmSlots.count < count) {
+		if (coldSlots.count == 0 && newArena() < 0)
+			return -1;
+		void* slot = coldSlots.slots[--coldSlots.count];
+		warmSlot(slot);
+		warmSlots.slots[warmSlots.count++] = slot;
+	}
+	return 0;
+}
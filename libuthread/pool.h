@@ -0,0 +1,66 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+/*
+ * Page pool
+ *
+ * The pool hands out page-aligned slots of TPS_SIZE bytes carved out of large
+ * anonymous mappings (arenas), so that creating or destroying a TPS does not
+ * cost an mmap()/munmap() and a new memory mapping each time. Every slot is
+ * kept PROT_NONE while it sits in the pool; its user is free to mprotect() it
+ * while it owns it, but must restore PROT_NONE before giving it back.
+ *
+ * Slots are always handed out zero-filled. Freed slots are either released to
+ * the kernel with MADV_DONTNEED, or, while the pool is short of its warm
+ * target, zeroed in place so that they stay resident.
+ *
+ * The pool is not thread-safe: the TPS API only calls it from within its
+ * critical section.
+ */
+
+/*
+ * pool_alloc - Allocate a slot
+ *
+ * Return: Address of a zero-filled PROT_NONE slot of TPS_SIZE bytes. NULL in
+ * case of failure when mapping a new arena.
+ */
+void *pool_alloc(void);
+
+/*
+ * pool_free - Give a slot back to the pool
+ * @slot: Slot previously returned by pool_alloc()
+ *
+ * The slot must be PROT_NONE again when it is given back.
+ */
+void pool_free(void *slot);
+
+/*
+ * pool_grow - Turn a slot into a larger mapping of its own
+ * @slot: Slot previously returned by pool_alloc()
+ * @size: Size in bytes of the new mapping
+ *
+ * Move the page of @slot, without copying it, to the start of a new PROT_NONE
+ * mapping of @size bytes whose remaining pages are zero-filled. @slot itself
+ * goes back to the pool.
+ *
+ * Return: Address of the new mapping. NULL in case of failure, in which case
+ * @slot is left untouched.
+ */
+void *pool_grow(void *slot, size_t size);
+
+/*
+ * pool_reserve - Prefault slots ahead of time
+ * @count: Number of warm slots to keep ready
+ *
+ * Make sure at least @count slots are mapped, resident and zeroed, so that the
+ * next @count calls to pool_alloc() neither map memory nor take a page fault
+ * on first access. The pool also keeps refilling its warm slots up to @count
+ * as slots are freed.
+ *
+ * Return: -1 in case of failure when mapping a new arena. 0 otherwise.
+ */
+int pool_reserve(size_t count);
+
+#endif /* _POOL_H */
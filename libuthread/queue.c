@@ -0,0 +1,321 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hazard.h"
+#include "queue.h"
+
+// Items a queue holds inside its own struct before it needs a buffer from the
+// heap, so that short queues never allocate past queue_create()
+#define QUEUE_INLINE_CAPACITY 8
+
+// Position of a running queue_iterate(): the index of the next item it visits.
+// Iterations in progress are chained so that deletions can keep them on track.
+typedef struct cursor {
+	size_t next;
+	struct cursor* outer;
+} cursor;
+
+// Items sit in a ring buffer, oldest at `head`. The capacity is always a power
+// of two, so that wrapping around is a mask.
+struct queue {
+	void** items;
+	size_t head;
+	size_t length;
+	size_t capacity;
+	cursor* cursors;
+	void* inlineItems[QUEUE_INLINE_CAPACITY];
+	// Set for queues made by queue_create_concurrent(), which leave the ring
+	// buffer unused
+	struct sharedQueue* shared;
+};
+
+// Michael-Scott queue: a linked list whose head is a dummy node, with items
+// enqueued at the tail and dequeued from the node after the head. Both ends
+// are updated with compare-and-swap only, and sit on separate cache lines so
+// that producers and consumers don't contend. Unlinked nodes are freed through
+// hazard pointers.
+typedef struct node {
+	void* _Atomic next;
+	void* data;
+} node;
+
+#define CACHE_LINE 64
+
+struct sharedQueue {
+	_Alignas(CACHE_LINE) void* _Atomic head;
+	_Alignas(CACHE_LINE) void* _Atomic tail;
+	// Enqueues minus dequeues, which may briefly lag behind either
+	_Alignas(CACHE_LINE) atomic_long length;
+};
+
+static void freeNode(void* n)
+{
+	free(n);
+}
+
+static int sharedEnqueue(struct sharedQueue* shared, void* data)
+{
+	if (hazard_register() < 0) return -1;
+	node* new = malloc(sizeof(node));
+	if (new == NULL) return -1;
+	new->data = data;
+	atomic_store(&new->next, NULL);
+
+	while (1) {
+		node* tail = hazard_protect(0, &shared->tail);
+		node* next = atomic_load(&tail->next);
+		if (tail != atomic_load(&shared->tail))
+			continue;
+		// Help a lagging enqueuer move the tail along before we go
+		if (next != NULL) {
+			atomic_compare_exchange_strong(&shared->tail, (void**) &tail, next);
+			continue;
+		}
+		void* expected = NULL;
+		if (atomic_compare_exchange_strong(&tail->next, &expected, new)) {
+			atomic_compare_exchange_strong(&shared->tail, (void**) &tail, new);
+			break;
+		}
+	}
+	hazard_clear();
+	atomic_fetch_add(&shared->length, 1);
+	return 0;
+}
+
+static int sharedDequeue(struct sharedQueue* shared, void** data)
+{
+	if (hazard_register() < 0) return -1;
+
+	while (1) {
+		node* head = hazard_protect(0, &shared->head);
+		node* tail = atomic_load(&shared->tail);
+		// The next node can't be unlinked (let alone freed) for as long as
+		// the head hasn't moved past it
+		node* next = hazard_protect(1, &head->next);
+		if (head != atomic_load(&shared->head))
+			continue;
+		if (next == NULL) {
+			hazard_clear();
+			return -1;
+		}
+		if (head == tail) {
+			atomic_compare_exchange_strong(&shared->tail, (void**) &tail, next);
+			continue;
+		}
+		// The next node becomes the dummy, so its item is read first
+		void* item = next->data;
+		if (atomic_compare_exchange_strong(&shared->head, (void**) &head, next)) {
+			hazard_clear();
+			hazard_retire(head, freeNode);
+			atomic_fetch_sub(&shared->length, 1);
+			*data = item;
+			return 0;
+		}
+	}
+}
+
+static size_t slot(queue_t queue, size_t index)
+{
+	return (queue->head + index) & (queue->capacity - 1);
+}
+
+// Double the capacity, unwrapping the items to the start of the new buffer
+static int grow(queue_t queue)
+{
+	size_t capacity = queue->capacity * 2;
+	void** items = malloc(capacity * sizeof(void*));
+	if (items == NULL) return -1;
+
+	size_t first = queue->capacity - queue->head;
+	if (first > queue->length)
+		first = queue->length;
+	memcpy(items, queue->items + queue->head, first * sizeof(void*));
+	memcpy(items + first, queue->items, (queue->length - first) * sizeof(void*));
+
+	if (queue->items != queue->inlineItems)
+		free(queue->items);
+	queue->items = items;
+	queue->head = 0;
+	queue->capacity = capacity;
+	return 0;
+}
+
+queue_t queue_create(void)
+{
+	queue_t queue = malloc(sizeof(struct queue));
+	if (queue == NULL) return NULL;
+
+	queue->items = queue->inlineItems;
+	queue->head = 0;
+	queue->length = 0;
+	queue->capacity = QUEUE_INLINE_CAPACITY;
+	queue->cursors = NULL;
+	queue->shared = NULL;
+	return queue;
+}
+
+queue_t queue_create_concurrent(void)
+{
+	queue_t queue = queue_create();
+	if (queue == NULL) return NULL;
+
+	struct sharedQueue* shared = aligned_alloc(CACHE_LINE, sizeof(struct sharedQueue));
+	node* dummy = malloc(sizeof(node));
+	if (shared == NULL || dummy == NULL) {
+		free(shared);
+		free(dummy);
+		free(queue);
+		return NULL;
+	}
+	atomic_store(&dummy->next, NULL);
+	atomic_store(&shared->head, dummy);
+	atomic_store(&shared->tail, dummy);
+	atomic_store(&shared->length, 0);
+	queue->shared = shared;
+	return queue;
+}
+
+int queue_destroy(queue_t queue)
+{
+	if (queue == NULL || queue_length(queue) > 0) return -1;
+
+	if (queue->shared != NULL) {
+		// Nobody else may use the queue by now, so the dummy goes right away
+		free(atomic_load(&queue->shared->head));
+		free(queue->shared);
+	}
+	if (queue->items != queue->inlineItems)
+		free(queue->items);
+	free(queue);
+	return 0;
+}
+
+int queue_enqueue(queue_t queue, void *data)
+{
+	if (queue == NULL || data == NULL) return -1;
+	if (queue->shared != NULL) return sharedEnqueue(queue->shared, data);
+	if (queue->length == queue->capacity && grow(queue) < 0) return -1;
+
+	queue->items[slot(queue, queue->length)] = data;
+	queue->length++;
+	return 0;
+}
+
+static size_t min(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+// Move @n items from index @from to index @to of the queue, either range maybe
+// wrapping around the end of the buffer, in pieces that are contiguous in both
+static void moveItems(queue_t queue, size_t to, size_t from, size_t n)
+{
+	while (n > 0) {
+		size_t src, dst, piece;
+		if (to < from) {
+			// Front to back, so that nothing is overwritten before it moves
+			src = slot(queue, from);
+			dst = slot(queue, to);
+			piece = min(n, min(queue->capacity - src, queue->capacity - dst));
+			from += piece;
+			to += piece;
+		} else {
+			src = slot(queue, from + n - 1);
+			dst = slot(queue, to + n - 1);
+			piece = min(n, min(src, dst) + 1);
+			src -= piece - 1;
+			dst -= piece - 1;
+		}
+		memmove(queue->items + dst, queue->items + src, piece * sizeof(void*));
+		n -= piece;
+	}
+}
+
+// Remove the item at @index, closing the gap from whichever end is nearer
+static void removeAt(queue_t queue, size_t index)
+{
+	if (index < queue->length / 2) {
+		moveItems(queue, 1, 0, index);
+		queue->head = slot(queue, 1);
+	} else {
+		moveItems(queue, index, index + 1, queue->length - index - 1);
+	}
+	queue->length--;
+
+	// Every item behind it moved up by one, so iterations past it follow
+	for (cursor* c = queue->cursors; c != NULL; c = c->outer)
+		if (c->next > index)
+			c->next--;
+}
+
+int queue_dequeue(queue_t queue, void **data)
+{
+	if (queue == NULL || data == NULL) return -1;
+	if (queue->shared != NULL) return sharedDequeue(queue->shared, data);
+	if (queue->length == 0) return -1;
+
+	*data = queue->items[queue->head];
+	removeAt(queue, 0);
+	return 0;
+}
+
+// Index of the oldest item equal to @data, or -1. The buffer is scanned as the
+// (at most) two contiguous runs it holds.
+static long find(queue_t queue, void* data)
+{
+	size_t first = queue->capacity - queue->head;
+	if (first > queue->length)
+		first = queue->length;
+
+	void** run = queue->items + queue->head;
+	for (size_t i = 0; i < first; i++)
+		if (run[i] == data)
+			return i;
+	for (size_t i = 0; i < queue->length - first; i++)
+		if (queue->items[i] == data)
+			return first + i;
+	return -1;
+}
+
+int queue_delete(queue_t queue, void *data)
+{
+	if (queue == NULL || data == NULL || queue->shared != NULL) return -1;
+
+	long index = find(queue, data);
+	if (index < 0) return -1;
+	removeAt(queue, index);
+	return 0;
+}
+
+int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data)
+{
+	if (queue == NULL || func == NULL || queue->shared != NULL) return -1;
+
+	// The buffer may be moved or reshuffled by @func, so items are looked up
+	// by index each time
+	cursor self = { 0, queue->cursors };
+	queue->cursors = &self;
+	while (self.next < queue->length) {
+		void* item = queue->items[slot(queue, self.next)];
+		self.next++;
+		if (func(item, arg) == 1) {
+			if (data != NULL)
+				*data = item;
+			break;
+		}
+	}
+	queue->cursors = self.outer;
+	return 0;
+}
+
+int queue_length(queue_t queue)
+{
+	if (queue == NULL) return -1;
+	if (queue->shared != NULL) {
+		long length = atomic_load(&queue->shared->length);
+		return length > 0 ? length : 0;
+	}
+	return queue->length;
+}
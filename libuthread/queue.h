@@ -9,6 +9,8 @@
  * first and so on.
  *
  * Apart from delete and iterate operations, all operations should be O(1).
+ * Items are kept in a growable ring buffer, so enqueueing is amortized O(1) and
+ * never allocates for a queue that stays short.
  */
 typedef struct queue* queue_t;
 
@@ -22,6 +24,24 @@ typedef struct queue* queue_t;
  */
 queue_t queue_create(void);
 
+/*
+ * queue_create_concurrent - Allocate an empty queue shared between threads
+ *
+ * Create a queue that any number of threads can enqueue to and dequeue from at
+ * the same time without an outer lock. Enqueueing and dequeueing are lock-free
+ * and allocate one node per item; nodes are freed once no thread can still be
+ * reading them.
+ *
+ * Only queue_enqueue(), queue_dequeue() and queue_length() are supported on
+ * such a queue: queue_delete() and queue_iterate() fail. The length is only a
+ * snapshot while other threads use the queue, and queue_destroy() must not
+ * race with any other operation.
+ *
+ * Return: Pointer to new empty queue. NULL in case of failure when allocating
+ * the new queue.
+ */
+queue_t queue_create_concurrent(void);
+
 /*
  * queue_destroy - Deallocate a queue
  * @queue: Queue to deallocate
@@ -67,7 +87,8 @@ int queue_dequeue(queue_t queue, void **data);
  * this item.
  *
  * Return: -1 if @queue or @data are NULL, of if @data was not found in the
- * queue. 0 if @data was found and deleted from @queue.
+ * queue, or if @queue is concurrent. 0 if @data was found and deleted from
+ * @queue.
  */
 int queue_delete(queue_t queue, void *data);
 
@@ -98,7 +119,8 @@ typedef int (*queue_func_t)(void *data, void *arg);
  * We assume that queue_delete() cannot be called inside @func on the current
  * data item. Doing so would result in undefined behavior.
  *
- * Return: -1 if @queue or @func are NULL, 0 otherwise.
+ * Return: -1 if @queue or @func are NULL, or if @queue is concurrent. 0
+ * otherwise.
  */
 int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data);
 
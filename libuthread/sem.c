@@ -1,25 +1,396 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "queue.h"
 #include "sem.h"
 #include "thread.h"
+#include "timer.h"
+#include "trace.h"
+#include "util.h"
 
-#include <stdio.h>
+// A thread sleeping in sem_down(). It lives on the sleeping thread's stack and
+// is only ever touched while holding the lock of the semaphore it waits on.
+// Waiters are linked into the queue through `next` and `prev`, so that
+// queueing, waking or cancelling one never allocates memory. A waiter with a
+// deadline also has a timer, which sets `timedOut` and takes the waiter out of
+// the queue.
+//
+// A thread sleeping in sem_down_any() has one waiter in the queue of each of
+// its semaphores, all pointing to the same record (`any`) on its stack, which
+// holds the parker it sleeps on.
+typedef struct anyWait anyWait;
+
+typedef struct waiter {
+	struct waiter* next;
+	struct waiter* prev;
+	struct thread_parker parker;
+	int woken;
+	// Set when woken by a handoff, with the resources already taken for us
+	int granted;
+	// Number of resources the thread is waiting for, and how many of them
+	// were promised to it when it was woken
+	size_t n;
+	size_t promised;
+	sem_t sem;
+	int timedOut;
+	struct timer_entry timer;
+	// Set for waiters of sem_down_any(), along with the semaphore's index
+	anyWait* any;
+	size_t index;
+} waiter;
+
+// Only the first semaphore to wake a sem_down_any() waiter gets it: it claims
+// the record with its index, and the others drop their waiter from their queue
+// as they come across it
+#define UNCLAIMED	SIZE_MAX
+
+struct anyWait {
+	struct thread_parker parker;
+	atomic_size_t claimed;
+};
+
+// FIFO of waiters, oldest first
+typedef struct waitQueue {
+	waiter* head;
+	waiter* tail;
+	int length;
+} waitQueue;
 
+// Contention counters, only updated while statistics are enabled. They are
+// relaxed atomics: nothing else is ordered by them.
+typedef struct semStats {
+	atomic_uint_least64_t downs;
+	atomic_uint_least64_t ups;
+	atomic_uint_least64_t blocked;
+	atomic_uint_least64_t reblocks;
+	atomic_uint_least64_t waitTotal;
+	atomic_uint_least64_t waitMax;
+	atomic_uint_least64_t waitHist[SEM_STATS_BUCKETS];
+} semStats;
+
+// Every semaphore has its own lock, so unrelated semaphores never contend
+// with each other (or with the TPS API) on the global critical section.
+// The count is atomic so that uncontended downs and ups never take the lock:
+// the lock and the queue are only used once a thread has to wait, and
+// `waiters` tells sem_up() whether anyone might need waking. `promised` is
+// the number of resources that woken waiters are about to try for, which
+// further wakeups leave to them. `upsInFlight` counts the ups that have added
+// to the count but may still be about to touch the semaphore: a thread whose
+// down they satisfied may destroy it meanwhile, and sem_destroy() waits for
+// them first.
 typedef struct semaphore {
-	size_t count;
-	queue_t blockedQueue;
+	atomic_size_t count;
+	atomic_size_t waiters;
+	atomic_size_t upsInFlight;
+	waitQueue blockedQueue;
+	size_t promised;
+	int policy;
+	// How long sem_down() spins before going to sleep, learned from how long
+	// recent spins took to succeed
+	atomic_uint spinLimit;
+	pthread_mutex_t lock;
+	semStats stats;
+	// Links in the list of live semaphores, for sem_stats_dump()
+	struct semaphore* nextSem;
+	struct semaphore* prevSem;
 } semaphore;
 
+static atomic_int statsEnabled;
+
+static pthread_mutex_t allSemsLock = PTHREAD_MUTEX_INITIALIZER;
+static semaphore* allSems;
+
+// Bounds of a semaphore's spin limit, in iterations of the spin loop
+#define SPIN_MIN	16
+#define SPIN_MAX	4096
+#define SPIN_INITIAL	256
+
+// Tell the CPU we are busy-waiting, which frees up resources for its sibling
+// hyperthread and avoids a memory order violation when the loop exits
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Spinning only makes sense if the thread we wait for can run meanwhile. The
+// number of CPUs is looked up once; threads racing to do it all store the
+// same value.
+static int canSpin(void)
+{
+	static atomic_int ncpus;
+	int n = atomic_load_explicit(&ncpus, memory_order_relaxed);
+	if (n == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		atomic_store_explicit(&ncpus, n, memory_order_relaxed);
+	}
+	return n > 1;
+}
+
+// Take @n resources if that many are available, all at once with a single
+// CAS: a thread never holds on to part of what it asked for
+static int tryTake(sem_t sem, size_t n)
+{
+	size_t count = atomic_load(&sem->count);
+	while (count >= n) {
+		if (atomic_compare_exchange_weak(&sem->count, &count, count - n))
+			return 1;
+	}
+	return 0;
+}
+
+// Take @n resources, unless the semaphore hands resources off and others are
+// already waiting for them: it is then their turn first
+static int takeInTurn(sem_t sem, size_t n)
+{
+	if (sem->policy == SEM_HANDOFF && atomic_load(&sem->waiters) > 0)
+		return 0;
+	return tryTake(sem, n);
+}
+
+// Spin for a little while in case @n resources come up soon, which is much
+// cheaper than sleeping and being woken up. The limit follows how long recent
+// successful spins took, with room to learn that a bit more would do, and
+// shrinks when spinning fails, so that long waits soon stop burning CPU.
+static int spinTake(sem_t sem, size_t n)
+{
+	if (!canSpin()) return 0;
+
+	unsigned limit = atomic_load_explicit(&sem->spinLimit, memory_order_relaxed);
+	unsigned tries = limit * 2 < SPIN_MAX ? limit * 2 : SPIN_MAX;
+	for (unsigned i = 0; i < tries; i++) {
+		cpuRelax();
+		if (atomic_load_explicit(&sem->count, memory_order_relaxed) >= n && takeInTurn(sem, n)) {
+			limit += ((int) i - (int) limit) / 8;
+			if (limit < SPIN_MIN) limit = SPIN_MIN;
+			atomic_store_explicit(&sem->spinLimit, limit, memory_order_relaxed);
+			return 1;
+		}
+	}
+	limit -= limit / 8;
+	if (limit < SPIN_MIN) limit = SPIN_MIN;
+	atomic_store_explicit(&sem->spinLimit, limit, memory_order_relaxed);
+	return 0;
+}
+
+static inline int statsOn(void)
+{
+	return atomic_load_explicit(&statsEnabled, memory_order_relaxed);
+}
+
+static inline void statAdd(atomic_uint_least64_t* counter, uint64_t n)
+{
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// Account for a down that had to sleep, from @start on, and had to go back to
+// sleep @reblocks times after being woken
+static void statBlocked(sem_t sem, uint64_t start, uint64_t reblocks)
+{
+	semStats* stats = &sem->stats;
+	uint64_t wait = nowNs() - start;
+
+	statAdd(&stats->blocked, 1);
+	statAdd(&stats->reblocks, reblocks);
+	statAdd(&stats->waitTotal, wait);
+	uint64_t max = atomic_load_explicit(&stats->waitMax, memory_order_relaxed);
+	while (wait > max && !atomic_compare_exchange_weak_explicit(&stats->waitMax, &max, wait, memory_order_relaxed, memory_order_relaxed))
+		;
+
+	int bucket = wait > 1 ? 63 - __builtin_clzll(wait) : 0;
+	if (bucket >= SEM_STATS_BUCKETS)
+		bucket = SEM_STATS_BUCKETS - 1;
+	statAdd(&stats->waitHist[bucket], 1);
+}
+
+static void enqueueWaiter(waitQueue* queue, waiter* w)
+{
+	w->next = NULL;
+	w->prev = queue->tail;
+	if (queue->tail != NULL)
+		queue->tail->next = w;
+	else
+		queue->head = w;
+	queue->tail = w;
+	queue->length++;
+}
+
+// Unlink @w, wherever it is in the queue
+static void removeWaiter(waitQueue* queue, waiter* w)
+{
+	if (w->prev != NULL)
+		w->prev->next = w->next;
+	else
+		queue->head = w->next;
+	if (w->next != NULL)
+		w->next->prev = w->prev;
+	else
+		queue->tail = w->prev;
+	queue->length--;
+}
+
+// Claim @w for a wakeup, which only fails for a sem_down_any() waiter already
+// woken by another of its semaphores
+static int claim(waiter* w)
+{
+	if (w->any == NULL) return 1;
+	size_t unclaimed = UNCLAIMED;
+	return atomic_compare_exchange_strong(&w->any->claimed, &unclaimed, w->index);
+}
+
+// Take out a waiter whose thread has been woken through another semaphore. Its
+// thread takes care of it under our lock before leaving.
+static void dropWaiter(sem_t sem, waiter* w)
+{
+	removeWaiter(&sem->blockedQueue, w);
+	w->woken = 1;
+}
+
+// Waiters taken out of the queue under the semaphore's lock, to be woken up
+// once it is dropped: they would otherwise wake up only to wait for the lock.
+// They are linked through `next`, oldest first.
+typedef struct wakeList {
+	waiter* head;
+	waiter** tail;
+} wakeList;
+
+static void initWakeList(wakeList* list)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+}
+
+static void wakeLater(sem_t sem, waiter* w, wakeList* list)
+{
+	removeWaiter(&sem->blockedQueue, w);
+	w->woken = 1;
+	w->next = NULL;
+	*list->tail = w;
+	list->tail = &w->next;
+}
+
+// Wake up every waiter of @list, with the semaphore's lock dropped. A waiter
+// may be gone as soon as it is woken, so we are done with it by then.
+static void wakeAll(wakeList* list)
+{
+	waiter* w = list->head;
+	while (w != NULL) {
+		waiter* next = w->next;
+		thread_unpark(w->any != NULL ? &w->any->parker : &w->parker);
+		w = next;
+	}
+}
+
+// Take the resources of the waiters at the head of the queue on their behalf,
+// for as long as there are enough, and wake them up
+static void handOff(sem_t sem, wakeList* list)
+{
+	waiter* first;
+	while ((first = sem->blockedQueue.head) != NULL && tryTake(sem, first->n)) {
+		if (!claim(first)) {
+			atomic_fetch_add(&sem->count, first->n);
+			dropWaiter(sem, first);
+			continue;
+		}
+		first->granted = 1;
+		TRACE_INSTANT("sem_handoff", "sem", sem);
+		wakeLater(sem, first, list);
+	}
+}
+
+// Wake, in one pass from the head of the queue, as many waiters as the
+// available resources can satisfy. The pass stops at the first waiter that
+// asks for more than is left, so that small requests can't keep overtaking a
+// large one.
+static void wakeWaiters(sem_t sem, wakeList* list)
+{
+	if (sem->policy == SEM_HANDOFF) {
+		handOff(sem, list);
+		return;
+	}
+
+	size_t count = atomic_load(&sem->count);
+	size_t budget = count > sem->promised ? count - sem->promised : 0;
+	while (budget > 0) {
+		waiter* first = sem->blockedQueue.head;
+		if (first == NULL || first->n > budget)
+			break;
+		if (!claim(first)) {
+			dropWaiter(sem, first);
+			continue;
+		}
+		budget -= first->n;
+		sem->promised += first->n;
+		first->promised = first->n;
+		TRACE_INSTANT("sem_wake", "sem", sem);
+		wakeLater(sem, first, list);
+	}
+}
+
+// Give @n resources to @sem, and wake up whoever they can satisfy
+static void release(sem_t sem, size_t n)
+{
+	atomic_fetch_add(&sem->upsInFlight, 1);
+	atomic_fetch_add(&sem->count, n);
+	// Uncontended case: nobody is sleeping, so there is no one to wake up
+	if (atomic_load(&sem->waiters) == 0) {
+		atomic_fetch_sub(&sem->upsInFlight, 1);
+		return;
+	}
+
+	// There are blocked threads, so unblock the oldest ones we can satisfy, in
+	// one batch once the lock is dropped
+	wakeList list;
+	initWakeList(&list);
+	pthread_mutex_lock(&sem->lock);
+	wakeWaiters(sem, &list);
+	pthread_mutex_unlock(&sem->lock);
+	wakeAll(&list);
+	atomic_fetch_sub(&sem->upsInFlight, 1);
+}
+
 sem_t sem_create(size_t count)
 {
+	return sem_create_policy(count, SEM_BARGING);
+}
+
+sem_t sem_create_policy(size_t count, int policy)
+{
+	if (policy != SEM_BARGING && policy != SEM_HANDOFF) return NULL;
+
 	sem_t newSem = malloc(sizeof(semaphore));
 	if (newSem == NULL) return NULL;
-	newSem->count = count;
-	queue_t newQueue = queue_create();
-	if (newQueue == NULL) return NULL;
-	newSem->blockedQueue = newQueue;
+	atomic_init(&newSem->count, count);
+	atomic_init(&newSem->waiters, 0);
+	atomic_init(&newSem->upsInFlight, 0);
+	newSem->blockedQueue.head = NULL;
+	newSem->blockedQueue.tail = NULL;
+	newSem->blockedQueue.length = 0;
+	newSem->promised = 0;
+	newSem->policy = policy;
+	atomic_init(&newSem->spinLimit, SPIN_INITIAL);
+	pthread_mutex_init(&newSem->lock, NULL);
+	memset(&newSem->stats, 0, sizeof(semStats));
+
+	pthread_mutex_lock(&allSemsLock);
+	newSem->prevSem = NULL;
+	newSem->nextSem = allSems;
+	if (allSems != NULL)
+		allSems->prevSem = newSem;
+	allSems = newSem;
+	pthread_mutex_unlock(&allSemsLock);
 	return newSem;
 }
 
@@ -27,56 +398,350 @@ int sem_destroy(sem_t sem)
 {
 	if (sem == NULL) return -1;
 	// Can't destroy semaphore if it still contains blocked threads.
-	if (queue_length(sem->blockedQueue) > 0) return -1;
-	if (queue_destroy(sem->blockedQueue) < 0) return -1;
+	if (atomic_load(&sem->waiters) > 0) return -1;
+	// An up that already let its resource go may not be done with the
+	// semaphore yet
+	while (atomic_load(&sem->upsInFlight) > 0)
+		sched_yield();
+
+	pthread_mutex_lock(&allSemsLock);
+	if (sem->prevSem != NULL)
+		sem->prevSem->nextSem = sem->nextSem;
+	else
+		allSems = sem->nextSem;
+	if (sem->nextSem != NULL)
+		sem->nextSem->prevSem = sem->prevSem;
+	pthread_mutex_unlock(&allSemsLock);
+
+	pthread_mutex_destroy(&sem->lock);
 	free(sem);
 	return 0;
 }
 
-int sem_down(sem_t sem)
+// Runs on the timer wheel's thread once a waiter's deadline has passed
+static void expire(void *arg)
 {
-	enter_critical_section();
-	if (sem == NULL) return -1;
+	waiter* self = arg;
+	wakeList list;
+	initWakeList(&list);
+
+	pthread_mutex_lock(&self->sem->lock);
+	self->timedOut = 1;
+	// A waiter that sem_up() already took out of the queue gets to try for
+	// the resources it was woken for first
+	if (!self->woken) {
+		wakeLater(self->sem, self, &list);
+		// Waiters behind us may ask for less than we did
+		wakeWaiters(self->sem, &list);
+	}
+	pthread_mutex_unlock(&self->sem->lock);
+	wakeAll(&list);
+}
+
+// Wait for @n resources, until @deadline if it isn't NULL
+static int down(sem_t sem, size_t n, const struct timespec *deadline)
+{
+	if (sem == NULL || n == 0) return -1;
+	// Uncontended case, or a short wait: no lock, no queue
+	if (takeInTurn(sem, n) || spinTake(sem, n)) {
+		if (statsOn())
+			statAdd(&sem->stats.downs, 1);
+		return 0;
+	}
+	int stats = statsOn();
+	uint64_t start = stats ? nowNs() : 0;
+	uint64_t parks = 0;
+
+	waiter self;
+	self.n = n;
+	self.promised = 0;
+	self.granted = 0;
+	self.sem = sem;
+	// Not in the queue yet, as far as the timer is concerned
+	self.woken = 1;
+	self.timedOut = 0;
+	self.any = NULL;
+	if (deadline != NULL && timer_arm(&self.timer, deadline, expire, &self) < 0)
+		return -1;
+
+	pthread_mutex_lock(&sem->lock);
+	// Announce ourselves before checking the count again, so that a sem_up()
+	// racing with us either sees us waiting or leaves a resource we can take.
+	// With handoffs, we may only take resources if nobody queued before us.
+	atomic_fetch_add(&sem->waiters, 1);
+	int first = sem->policy != SEM_HANDOFF || sem->blockedQueue.length == 0;
 	// No resources left, so wait in queue
 	// Keep checking whether the sem count is 0 because another thread could interrupt and steal the resource before this thread is scheduled
-	while (sem->count <= 0) {
-		pthread_t tid = pthread_self();
-		if (queue_enqueue(sem->blockedQueue, (void*) tid) < 0) return -1;
-		if (thread_block() < 0) return -1;
-	}
-	
-	sem->count--;
-	exit_critical_section();
+	// (a handoff hands us the resources directly instead)
+	int ret = 0;
+	while (!self.granted && !(first && tryTake(sem, n))) {
+		if (self.timedOut) {
+			ret = -1;
+			break;
+		}
+		thread_parker_init(&self.parker);
+		enqueueWaiter(&sem->blockedQueue, &self);
+		self.woken = 0;
+		pthread_mutex_unlock(&sem->lock);
+		TRACE_BEGIN("sem_down", "sem", sem);
+		thread_park(&self.parker);
+		TRACE_END("sem_down");
+		parks++;
+		pthread_mutex_lock(&sem->lock);
+		// Resources set aside for us no longer are once we've had our go
+		sem->promised -= self.promised;
+		self.promised = 0;
+		// With handoffs, only a timeout wakes us up without the resources,
+		// and it isn't our turn to take them any more than before
+		first = sem->policy != SEM_HANDOFF;
+	}
+	atomic_fetch_sub(&sem->waiters, 1);
+	// Whatever we leave (or didn't get to) may satisfy someone behind us
+	wakeList list;
+	initWakeList(&list);
+	wakeWaiters(sem, &list);
+	pthread_mutex_unlock(&sem->lock);
+	wakeAll(&list);
+
+	// The timer takes the semaphore's lock, so it is cancelled without it
+	if (deadline != NULL)
+		timer_cancel(&self.timer);
+
+	if (stats) {
+		if (ret == 0)
+			statAdd(&sem->stats.downs, 1);
+		if (parks > 0)
+			statBlocked(sem, start, parks - 1);
+	}
+	return ret;
+}
+
+int sem_down(sem_t sem)
+{
+	return down(sem, 1, NULL);
+}
+
+int sem_down_n(sem_t sem, size_t n)
+{
+	return down(sem, n, NULL);
+}
+
+int sem_down_timeout(sem_t sem, const struct timespec *deadline)
+{
+	if (deadline == NULL) return -1;
+	return down(sem, 1, deadline);
+}
+
+// Queue @w up on @sem for sem_down_any(), unless a resource can be taken right
+// away. Return whether one was.
+static int anyEnqueue(sem_t sem, waiter* w)
+{
+	pthread_mutex_lock(&sem->lock);
+	atomic_fetch_add(&sem->waiters, 1);
+	int first = sem->policy != SEM_HANDOFF || sem->blockedQueue.length == 0;
+	if (first && tryTake(sem, 1)) {
+		atomic_fetch_sub(&sem->waiters, 1);
+		pthread_mutex_unlock(&sem->lock);
+		return 1;
+	}
+	w->n = 1;
+	w->promised = 0;
+	w->granted = 0;
+	w->woken = 0;
+	w->timedOut = 0;
+	w->sem = sem;
+	enqueueWaiter(&sem->blockedQueue, w);
+	pthread_mutex_unlock(&sem->lock);
 	return 0;
 }
 
-int sem_up(sem_t sem)
+// Take @w back out of @sem's queue, if it is still there. Return whether it
+// got us a resource: @w was granted one, or woke us up and one is still left.
+// A resource granted after we already got one elsewhere goes back.
+static int anyDequeue(sem_t sem, waiter* w, int taken)
 {
-	enter_critical_section();
-	if (sem == NULL) return -1;
-	// There are blocked threads, so unblock oldest one
-	if (queue_length(sem->blockedQueue) > 0) {
-		pthread_t unblockedTid;
-		if (queue_dequeue(sem->blockedQueue, (void**) &unblockedTid) < 0) {
-			exit_critical_section();
-			return -1;
+	wakeList list;
+	initWakeList(&list);
+	int got = 0;
+
+	pthread_mutex_lock(&sem->lock);
+	if (!w->woken)
+		removeWaiter(&sem->blockedQueue, w);
+	sem->promised -= w->promised;
+	if (w->granted) {
+		if (taken)
+			atomic_fetch_add(&sem->count, 1);
+		else
+			got = 1;
+	} else if (!taken && atomic_load(&w->any->claimed) == w->index) {
+		got = tryTake(sem, 1);
+	}
+	atomic_fetch_sub(&sem->waiters, 1);
+	wakeWaiters(sem, &list);
+	pthread_mutex_unlock(&sem->lock);
+	wakeAll(&list);
+	return got;
+}
+
+// Waiters for sem_down_any() live on the stack up to this many semaphores
+#define ANY_INLINE	8
+
+int sem_down_any(sem_t *sems, size_t n, size_t *index)
+{
+	if (sems == NULL || n == 0 || index == NULL) return -1;
+	for (size_t i = 0; i < n; i++)
+		if (sems[i] == NULL) return -1;
+
+	waiter inlineWaiters[ANY_INLINE];
+	waiter* waiters = inlineWaiters;
+	anyWait any;
+	int stats = statsOn();
+	uint64_t start = 0;
+	uint64_t parks = 0;
+
+	while (1) {
+		for (size_t i = 0; i < n; i++) {
+			if (takeInTurn(sems[i], 1)) {
+				*index = i;
+				goto out;
+			}
+		}
+
+		if (n > ANY_INLINE && waiters == inlineWaiters) {
+			waiters = malloc(n * sizeof(waiter));
+			if (waiters == NULL) return -1;
+		}
+
+		// Register with every semaphore, and sleep until one of them
+		// claims us
+		thread_parker_init(&any.parker);
+		atomic_init(&any.claimed, UNCLAIMED);
+		size_t queued = 0;
+		size_t taken = UNCLAIMED;
+		while (queued < n && atomic_load(&any.claimed) == UNCLAIMED) {
+			waiter* w = &waiters[queued];
+			w->any = &any;
+			w->index = queued;
+			if (anyEnqueue(sems[queued], w)) {
+				// Turn away the semaphores that may be waking us
+				// meanwhile. If one already did, its resource is
+				// ours and the one we took goes back; we still have
+				// to wait for its wakeup, which may not have reached
+				// our parker yet.
+				size_t unclaimed = UNCLAIMED;
+				if (atomic_compare_exchange_strong(&any.claimed, &unclaimed, queued))
+					taken = queued;
+				else
+					release(sems[queued], 1);
+				break;
+			}
+			queued++;
 		}
-		if (thread_unblock(unblockedTid) < 0) {
-			exit_critical_section();
-			return -1;
+		if (taken == UNCLAIMED) {
+			if (stats && parks == 0)
+				start = nowNs();
+			TRACE_BEGIN("sem_down_any", "sems", sems);
+			thread_park(&any.parker);
+			TRACE_END("sem_down_any");
+			parks++;
 		}
+
+		// Leave the other queues, and return what we don't need
+		for (size_t i = 0; i < queued; i++) {
+			if (anyDequeue(sems[i], &waiters[i], taken != UNCLAIMED))
+				taken = i;
+		}
+		if (taken != UNCLAIMED) {
+			*index = taken;
+			break;
+		}
+	}
+
+out:
+	if (waiters != inlineWaiters)
+		free(waiters);
+	if (stats) {
+		statAdd(&sems[*index]->stats.downs, 1);
+		if (parks > 0)
+			statBlocked(sems[*index], start, parks - 1);
 	}
-	sem->count++;
-	exit_critical_section();
+	return 0;
+}
+
+int sem_trydown(sem_t sem)
+{
+	if (sem == NULL || !takeInTurn(sem, 1)) return -1;
+	if (statsOn())
+		statAdd(&sem->stats.downs, 1);
+	return 0;
+}
+
+int sem_up(sem_t sem)
+{
+	return sem_up_n(sem, 1);
+}
+
+int sem_up_n(sem_t sem, size_t n)
+{
+	if (sem == NULL || n == 0) return -1;
+	if (statsOn())
+		statAdd(&sem->stats.ups, 1);
+	release(sem, n);
 	return 0;
 }
 
 int sem_getvalue(sem_t sem, int *sval)
 {
-	enter_critical_section();
 	if (sem == NULL || sval == NULL) return -1;
-	*sval = sem->count;
-	exit_critical_section();
+	size_t count = atomic_load(&sem->count);
+	if (count > 0) {
+		*sval = count;
+		return 0;
+	}
+	// An empty semaphore reports how many threads are waiting on it
+	pthread_mutex_lock(&sem->lock);
+	*sval = -sem->blockedQueue.length;
+	pthread_mutex_unlock(&sem->lock);
+	return 0;
+}
+
+void sem_stats_enable(int enable)
+{
+	atomic_store(&statsEnabled, enable != 0);
+}
+
+int sem_getstats(sem_t sem, struct sem_stats *stats)
+{
+	if (sem == NULL || stats == NULL) return -1;
+	semStats* from = &sem->stats;
+	stats->downs = atomic_load_explicit(&from->downs, memory_order_relaxed);
+	stats->ups = atomic_load_explicit(&from->ups, memory_order_relaxed);
+	stats->blocked = atomic_load_explicit(&from->blocked, memory_order_relaxed);
+	stats->reblocks = atomic_load_explicit(&from->reblocks, memory_order_relaxed);
+	stats->wait_total_ns = atomic_load_explicit(&from->waitTotal, memory_order_relaxed);
+	stats->wait_max_ns = atomic_load_explicit(&from->waitMax, memory_order_relaxed);
+	for (int i = 0; i < SEM_STATS_BUCKETS; i++)
+		stats->wait_hist[i] = atomic_load_explicit(&from->waitHist[i], memory_order_relaxed);
 	return 0;
 }
 
+void sem_stats_dump(FILE *stream)
+{
+	if (stream == NULL) return;
+
+	pthread_mutex_lock(&allSemsLock);
+	for (semaphore* sem = allSems; sem != NULL; sem = sem->nextSem) {
+		struct sem_stats stats;
+		sem_getstats(sem, &stats);
+		fprintf(stream, "sem %p: downs %llu ups %llu blocked %llu reblocks %llu wait avg %llu ns max %llu ns\n",
+			(void*) sem, (unsigned long long) stats.downs, (unsigned long long) stats.ups,
+			(unsigned long long) stats.blocked, (unsigned long long) stats.reblocks,
+			(unsigned long long) (stats.blocked ? stats.wait_total_ns / stats.blocked : 0),
+			(unsigned long long) stats.wait_max_ns);
+		for (int i = 0; i < SEM_STATS_BUCKETS; i++) {
+			if (stats.wait_hist[i] > 0)
+				fprintf(stream, "  >= 2^%-2d ns: %llu\n", i, (unsigned long long) stats.wait_hist[i]);
+		}
+	}
+	pthread_mutex_unlock(&allSemsLock);
+}
@@ -2,7 +2,9 @@
 #define _SEMAPHORE_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
 
 /*
  * sem_t - Semaphore type
@@ -26,11 +28,50 @@ typedef struct semaphore *sem_t;
  */
 sem_t sem_create(size_t count);
 
+/*
+ * Semaphore policies
+ *
+ * SEM_BARGING: sem_up() makes the resource available and wakes the oldest
+ * waiter, which then competes for it with any other thread calling sem_down()
+ * in the meantime. A thread that is already running usually wins, keeps going
+ * without a context switch, and the resource never sits idle while the woken
+ * thread is being scheduled: this gives the best throughput. The price is
+ * fairness: a woken thread that loses goes back to the end of the queue, so
+ * waits are not FIFO and the worst-case latency is unbounded.
+ *
+ * SEM_HANDOFF: sem_up() hands the resource directly to the oldest waiter,
+ * which owns it when it wakes up and never has to check again; sem_down() and
+ * sem_trydown() don't take resources while others are waiting. Waiters are
+ * served in strict FIFO order and every wait is bounded by the number of
+ * threads ahead of it. The price is throughput under contention: every
+ * release to a waiter costs a context switch before the resource gets used,
+ * and threads that could have run right away queue up behind sleeping ones
+ * (a lock convoy).
+ */
+#define SEM_BARGING	0
+#define SEM_HANDOFF	1
+
+/*
+ * sem_create_policy - Create semaphore with a given policy
+ * @count: Semaphore count
+ * @policy: Semaphore policy
+ *
+ * Same as sem_create(), but selects how released resources reach waiting
+ * threads. sem_create(@count) is equivalent to sem_create_policy(@count,
+ * SEM_BARGING).
+ *
+ * Return: Pointer to initialized semaphore. NULL if @policy is invalid, or in
+ * case of failure when allocating the new semaphore.
+ */
+sem_t sem_create_policy(size_t count, int policy);
+
 /*
  * sem_destroy - Deallocate a semaphore
  * @sem: Semaphore to deallocate
  *
- * Deallocate semaphore @sem.
+ * Deallocate semaphore @sem. A thread may destroy @sem as soon as it is done
+ * with it, even if the sem_up() that woke it has not returned yet: the call
+ * waits for such ups to finish.
  *
  * Return: -1 if @sem is NULL or if other threads are still being blocked on
  * @sem. 0 is @sem was successfully destroyed.
@@ -50,6 +91,66 @@ int sem_destroy(sem_t sem);
  */
 int sem_down(sem_t sem);
 
+/*
+ * sem_down_n - Take several resources from a semaphore
+ * @sem: Semaphore to take
+ * @n: Number of resources to take
+ *
+ * Take @n resources from semaphore @sem at once: the caller is blocked until
+ * @n resources are available, and never holds on to only part of them while it
+ * waits. Waiters are served in order, so a waiter asking for many resources
+ * is not overtaken by waiters that queued up after it.
+ *
+ * Return: -1 if @sem is NULL or @n is 0. 0 if the resources were successfully
+ * taken.
+ */
+int sem_down_n(sem_t sem, size_t n);
+
+/*
+ * sem_down_any - Take any one of several semaphores
+ * @sems: Array of semaphores to take from
+ * @n: Number of semaphores in @sems
+ * @index: Address of data item where the index of the semaphore taken is
+ * received
+ *
+ * Take a single resource from whichever semaphore of @sems has one first. If
+ * several have one available right away, the one that comes first in @sems is
+ * taken. Otherwise the caller is blocked, waiting on all of @sems at once,
+ * until one of them can be taken.
+ *
+ * Return: -1 if @sems or @index is NULL, if @n is 0 or if any semaphore of
+ * @sems is NULL. 0 if a semaphore was successfully taken, with its index in
+ * @sems assigned to the data item pointed by @index.
+ */
+int sem_down_any(sem_t *sems, size_t n, size_t *index);
+
+/*
+ * sem_trydown - Take a semaphore if available
+ * @sem: Semaphore to take
+ *
+ * Take a resource from semaphore @sem if one is available right away, without
+ * ever blocking.
+ *
+ * Return: -1 if @sem is NULL or if no resource is available. 0 if semaphore was
+ * successfully taken.
+ */
+int sem_trydown(sem_t sem);
+
+/*
+ * sem_down_timeout - Take a semaphore, with a deadline
+ * @sem: Semaphore to take
+ * @deadline: Absolute CLOCK_MONOTONIC time after which to give up
+ *
+ * Same as sem_down(), but give up waiting once @deadline has passed. The
+ * deadline is enforced by a timer wheel shared by all semaphores with a
+ * resolution of about a millisecond (see timer.h), so the caller may stay
+ * blocked up to a millisecond past it.
+ *
+ * Return: -1 if @sem or @deadline is NULL, or if @deadline passed before a
+ * resource became available. 0 if semaphore was successfully taken.
+ */
+int sem_down_timeout(sem_t sem, const struct timespec *deadline);
+
 /*
  * sem_up - Release a semaphore
  * @sem: Semaphore to release
@@ -64,6 +165,20 @@ int sem_down(sem_t sem);
  */
 int sem_up(sem_t sem);
 
+/*
+ * sem_up_n - Release several resources to a semaphore
+ * @sem: Semaphore to release
+ * @n: Number of resources to release
+ *
+ * Release @n resources to semaphore @sem at once. Starting from the oldest,
+ * as many waiting threads as the available resources can satisfy are
+ * unblocked in a single pass over the waiting list.
+ *
+ * Return: -1 if @sem is NULL or @n is 0. 0 if the resources were successfully
+ * released.
+ */
+int sem_up_n(sem_t sem, size_t n);
+
 /*
  * sem_getvalue - Inspect semaphore's internal state
  * @sem: Semaphore to inspect
@@ -81,4 +196,70 @@ int sem_up(sem_t sem);
  */
 int sem_getvalue(sem_t sem, int *sval);
 
+/*
+ * Semaphore statistics
+ *
+ * Every semaphore keeps contention counters, which are only updated while
+ * statistics are enabled with sem_stats_enable(). They start out disabled, in
+ * which case each operation only pays for checking that they are.
+ *
+ * SEM_STATS_BUCKETS: number of buckets of the wait time histogram. Bucket i
+ * counts the waits that lasted between 2^i and 2^(i+1) nanoseconds, except for
+ * the last one, which also counts all longer waits.
+ */
+#define SEM_STATS_BUCKETS	32
+
+/*
+ * struct sem_stats - Semaphore statistics
+ * @downs: Number of successful sem_down*() and sem_trydown() calls
+ * @ups: Number of sem_up() and sem_up_n() calls
+ * @blocked: Number of downs that had to sleep
+ * @reblocks: Number of times a woken thread found its resources gone and went
+ * back to sleep
+ * @wait_total_ns: Total time spent sleeping by downs that had to, in
+ * nanoseconds
+ * @wait_max_ns: Longest such time
+ * @wait_hist: Histogram of such times (see SEM_STATS_BUCKETS)
+ */
+struct sem_stats {
+	uint64_t downs;
+	uint64_t ups;
+	uint64_t blocked;
+	uint64_t reblocks;
+	uint64_t wait_total_ns;
+	uint64_t wait_max_ns;
+	uint64_t wait_hist[SEM_STATS_BUCKETS];
+};
+
+/*
+ * sem_stats_enable - Turn statistics on or off
+ * @enable: Whether to update statistics from now on
+ *
+ * Turn the statistics of all semaphores on if @enable is non-zero, off
+ * otherwise. Counters keep their value while statistics are off.
+ */
+void sem_stats_enable(int enable);
+
+/*
+ * sem_getstats - Read semaphore's statistics
+ * @sem: Semaphore to inspect
+ * @stats: Address of structure where statistics are received
+ *
+ * Counters are read one by one while other threads may be updating them, so
+ * they are only consistent with each other when @sem is idle.
+ *
+ * Return: -1 if @sem or @stats are NULL. 0 if statistics were successfully
+ * read.
+ */
+int sem_getstats(sem_t sem, struct sem_stats *stats);
+
+/*
+ * sem_stats_dump - Print statistics of all semaphores
+ * @stream: Stream to print to
+ *
+ * Print the statistics of every live semaphore to @stream, one semaphore at a
+ * time, along with the non-empty buckets of its wait time histogram.
+ */
+void sem_stats_dump(FILE *stream);
+
 #endif /* _SEMAPHORE_H */
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thread.h"
+#include "trace.h"
+#include "util.h"
+
+// Every thread has a record of its own in thread-local storage, so that it
+// never has to be allocated. While the thread is blocked, the record sits in
+// the table of blocked threads, and the thread sleeps on the record's parker.
+typedef struct threadRecord {
+	pthread_t tid;
+	struct thread_parker parker;
+	// Chains the record in its bucket of the table
+	struct threadRecord* next;
+} threadRecord;
+
+static __thread threadRecord self;
+
+// Blocked threads indexed by TID, so that thread_unblock() finds its target in
+// constant time. Buckets are chained through the records themselves, so the
+// table never allocates: it just gets slower past a few thousand blocked
+// threads. Each bucket has its own lock, so blocking and unblocking never take
+// the critical section's mutex, and threads in different buckets don't contend.
+#define BLOCKED_TABLE_SIZE 1024
+static threadRecord* blockedTable[BLOCKED_TABLE_SIZE];
+static pthread_mutex_t blockedLocks[BLOCKED_TABLE_SIZE] = {
+	[0 ... BLOCKED_TABLE_SIZE - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t csMutex = PTHREAD_MUTEX_INITIALIZER;
+// How many times the thread has entered the critical section without leaving
+// it, and the parkers it released meanwhile, whose threads are only woken up
+// once it has really left
+static __thread int csDepth;
+static __thread struct thread_parker* pendingWakes;
+
+// Profiler: the call site that holds the critical section, and since when.
+// Call sites are added to the list of profiled sites when they first get in,
+// and their counters are only ever updated while holding the critical section.
+static atomic_int profiling;
+static _Atomic(struct cs_site*) profiledSites;
+static __thread struct cs_site* csSite;
+static __thread uint64_t csSince;
+// Call sites of the enter_critical_section() function rather than macro
+static struct cs_site unknownSite = { "?", 0, 0, NULL, 0, 0, 0, 0, 0, { 0 }, { 0 } };
+
+static void futexWait(atomic_int* word, int value)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(atomic_int* word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// A parker is done with as soon as its thread can run, since the thread may
+// then return (and the parker vanish) at any time. The futex wake that follows
+// is harmless even then: futex sleepers always check their word again.
+static void release(struct thread_parker* parker)
+{
+	atomic_store(&parker->parked, 0);
+	futexWake(&parker->parked);
+}
+
+static void profileTime(uint64_t time, uint64_t* total, uint64_t* max, uint64_t* hist)
+{
+	*total += time;
+	if (time > *max)
+		*max = time;
+	int bucket = time > 1 ? 63 - __builtin_clzll(time) : 0;
+	if (bucket >= CS_PROFILE_BUCKETS)
+		bucket = CS_PROFILE_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+// Take the lock of the critical section for @site. An uncontended lock only
+// costs the profiler one clock reading.
+static void acquire(struct cs_site* site)
+{
+	if (!atomic_load_explicit(&profiling, memory_order_relaxed)) {
+		pthread_mutex_lock(&csMutex);
+		csSite = NULL;
+		return;
+	}
+
+	uint64_t start = 0;
+	if (pthread_mutex_trylock(&csMutex) != 0) {
+		start = nowNs();
+		pthread_mutex_lock(&csMutex);
+	}
+	uint64_t now = nowNs();
+
+	if (!site->registered) {
+		site->registered = 1;
+		site->next = atomic_load(&profiledSites);
+		atomic_store(&profiledSites, site);
+	}
+	site->acquires++;
+	profileTime(start != 0 ? now - start : 0, &site->wait_total, &site->wait_max, site->wait_hist);
+	csSite = site;
+	csSince = now;
+}
+
+// Let go of the critical section for good, then issue all the wakeups
+// collected in it in one go: the threads would otherwise wake up only to wait
+// for the lock we held.
+static void leaveCriticalSection(void)
+{
+	struct cs_site* site = csSite;
+	if (site != NULL) {
+		profileTime(nowNs() - csSince, &site->hold_total, &site->hold_max, site->hold_hist);
+		csSite = NULL;
+	}
+
+	struct thread_parker* wake = pendingWakes;
+	pendingWakes = NULL;
+	pthread_mutex_unlock(&csMutex);
+
+	while (wake != NULL) {
+		struct thread_parker* next = wake->next;
+		release(wake);
+		wake = next;
+	}
+}
+
+void thread_parker_init(struct thread_parker *parker)
+{
+	atomic_store(&parker->parked, 1);
+}
+
+void thread_park(struct thread_parker *parker)
+{
+	while (atomic_load(&parker->parked))
+		futexWait(&parker->parked, 1);
+}
+
+void thread_unpark(struct thread_parker *parker)
+{
+	if (csDepth == 0) {
+		release(parker);
+		return;
+	}
+	parker->next = pendingWakes;
+	pendingWakes = parker;
+}
+
+void enter_critical_section_at(struct cs_site *site)
+{
+	if (csDepth++ == 0)
+		acquire(site);
+}
+
+void (enter_critical_section)(void)
+{
+	enter_critical_section_at(&unknownSite);
+}
+
+void exit_critical_section(void)
+{
+	if (--csDepth == 0)
+		leaveCriticalSection();
+}
+
+int thread_block(void)
+{
+	self.tid = pthread_self();
+	thread_parker_init(&self.parker);
+	size_t bucket = hashTid(self.tid) & (BLOCKED_TABLE_SIZE - 1);
+	pthread_mutex_lock(&blockedLocks[bucket]);
+	self.next = blockedTable[bucket];
+	blockedTable[bucket] = &self;
+	pthread_mutex_unlock(&blockedLocks[bucket]);
+
+	// Leave the critical section entirely while asleep, however deeply we
+	// were in it: we are in the table by then, so whoever unblocks us next
+	// finds us. Getting back in is accounted to whoever got us in first.
+	int depth = csDepth;
+	struct cs_site* site = csSite;
+	if (depth > 0) {
+		csDepth = 0;
+		leaveCriticalSection();
+	}
+	TRACE_BEGIN("thread_block", "tid", self.tid);
+	thread_park(&self.parker);
+	TRACE_END("thread_block");
+
+	if (depth > 0) {
+		if (site != NULL)
+			acquire(site);
+		else
+			pthread_mutex_lock(&csMutex);
+		csDepth = depth;
+	}
+	return 0;
+}
+
+int thread_unblock(pthread_t tid)
+{
+	size_t bucket = hashTid(tid) & (BLOCKED_TABLE_SIZE - 1);
+	pthread_mutex_lock(&blockedLocks[bucket]);
+	threadRecord** link = &blockedTable[bucket];
+	while (*link != NULL && !pthread_equal((*link)->tid, tid))
+		link = &(*link)->next;
+
+	threadRecord* target = *link;
+	if (target != NULL)
+		*link = target->next;
+	pthread_mutex_unlock(&blockedLocks[bucket]);
+	if (target == NULL) return -1;
+	TRACE_INSTANT("thread_unblock", "tid", tid);
+
+	// Once out of the table, the record is ours to release. If we are in
+	// the critical section, the wakeup itself waits until we leave it.
+	thread_unpark(&target->parker);
+	return 0;
+}
+
+// Append @s to the @len bytes of @buf, which holds up to @size
+static size_t putStr(char* buf, size_t len, size_t size, const char* s)
+{
+	while (*s != '\0' && len < size)
+		buf[len++] = *s++;
+	return len;
+}
+
+static size_t putNum(char* buf, size_t len, size_t size, uint64_t n)
+{
+	char digits[21];
+	int i = sizeof(digits) - 1;
+	digits[i] = '\0';
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	return putStr(buf, len, size, digits + i);
+}
+
+static size_t putHist(char* buf, size_t len, size_t size, const char* name, const uint64_t* hist)
+{
+	len = putStr(buf, len, size, "  ");
+	len = putStr(buf, len, size, name);
+	for (int i = 0; i < CS_PROFILE_BUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+		len = putStr(buf, len, size, " 2^");
+		len = putNum(buf, len, size, i);
+		len = putStr(buf, len, size, ":");
+		len = putNum(buf, len, size, hist[i]);
+	}
+	return putStr(buf, len, size, "\n");
+}
+
+// Formatted by hand rather than with stdio, which can't be used from a signal
+// handler
+void cs_profile_dump(int fd)
+{
+	const char* header = "critical section profile (times in ns)\n";
+	if (write(fd, header, strlen(header)) < 0)
+		return;
+
+	for (struct cs_site* site = atomic_load(&profiledSites); site != NULL; site = site->next) {
+		char buf[1024];
+		size_t len = 0, size = sizeof(buf);
+		uint64_t acquires = site->acquires;
+		if (acquires == 0)
+			continue;
+
+		len = putStr(buf, len, size, site->file);
+		len = putStr(buf, len, size, ":");
+		len = putNum(buf, len, size, site->line);
+		len = putStr(buf, len, size, ": acquires ");
+		len = putNum(buf, len, size, acquires);
+		len = putStr(buf, len, size, " wait avg ");
+		len = putNum(buf, len, size, site->wait_total / acquires);
+		len = putStr(buf, len, size, " max ");
+		len = putNum(buf, len, size, site->wait_max);
+		len = putStr(buf, len, size, " hold avg ");
+		len = putNum(buf, len, size, site->hold_total / acquires);
+		len = putStr(buf, len, size, " max ");
+		len = putNum(buf, len, size, site->hold_max);
+		len = putStr(buf, len, size, "\n");
+		len = putHist(buf, len, size, "wait", site->wait_hist);
+		len = putHist(buf, len, size, "hold", site->hold_hist);
+		if (write(fd, buf, len) < 0)
+			return;
+	}
+}
+
+static void dumpAtExit(void)
+{
+	cs_profile_dump(STDERR_FILENO);
+}
+
+static void dumpOnSignal(__attribute__((unused)) int signo)
+{
+	cs_profile_dump(STDERR_FILENO);
+}
+
+void cs_profile_enable(int enable)
+{
+	static atomic_flag atExit = ATOMIC_FLAG_INIT;
+	if (enable && !atomic_flag_test_and_set(&atExit))
+		atexit(dumpAtExit);
+	atomic_store(&profiling, enable != 0);
+}
+
+int cs_profile_dump_on_signal(int signo)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dumpOnSignal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	return sigaction(signo, &sa, NULL) < 0 ? -1 : 0;
+}
@@ -2,12 +2,15 @@
 #define _THREAD_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 /*
  * thread_block - Block thread
  *
  * By calling this function the current thread becomes blocked. It can only be
- * unblocked by another thread calling `thread_unblock()`.
+ * unblocked by another thread calling `thread_unblock()`. Neither function
+ * takes the critical section's lock: they can be called from outside of it.
  *
  * If this function is called in a critical section (i.e. within a block of code
  * located after a call to 'enter_critical_section()'), it will exit the
@@ -24,18 +27,64 @@ int thread_block(void);
  *
  * Unblock thread @tid and make it ready for scheduling.
  *
+ * If this function is called in a critical section, thread @tid is only woken
+ * up once the caller has left the critical section, so that it doesn't wake up
+ * just to wait for the caller to leave.
+ *
  * Return: -1 if @tid does not correspond to a currently blocked thread. 0 if
  * thread @tid was successfully unblocked.
  */
 int thread_unblock(pthread_t tid);
 
+/*
+ * cs_site - Critical section call site
+ *
+ * Profile of the critical sections entered from one place in the code, which
+ * enter_critical_section() keeps in a static record at every call site. Opaque
+ * to the user, who only declares it with CS_SITE_INIT.
+ */
+#define CS_PROFILE_BUCKETS	32
+
+struct cs_site {
+	const char *file;
+	int line;
+	int registered;
+	struct cs_site *next;
+	uint64_t acquires;
+	uint64_t wait_total;
+	uint64_t wait_max;
+	uint64_t hold_total;
+	uint64_t hold_max;
+	uint64_t wait_hist[CS_PROFILE_BUCKETS];
+	uint64_t hold_hist[CS_PROFILE_BUCKETS];
+};
+
+#define CS_SITE_INIT	{ __FILE__, __LINE__, 0, NULL, 0, 0, 0, 0, 0, { 0 }, { 0 } }
+
+/*
+ * enter_critical_section_at - Enter critical section from a call site
+ * @site: Record of the call site
+ *
+ * Same as enter_critical_section(), with the time spent waiting for and then
+ * holding the critical section accounted to @site while profiling is enabled.
+ */
+void enter_critical_section_at(struct cs_site *site);
+
 /*
  * enter_critical_section - Enter critical section
  *
  * Call this function when entering a critical section in order to ensure mutual
  * exclusion with other threads.
+ *
+ * This is a macro that gives every call site a record of its own for the
+ * profiler (see cs_profile_enable()); the function of the same name accounts
+ * all the critical sections entered through it to a single record.
  */
 void enter_critical_section(void);
+#define enter_critical_section() do { \
+	static struct cs_site _cs_site = CS_SITE_INIT; \
+	enter_critical_section_at(&_cs_site); \
+} while (0)
 
 /*
  * exit_critical_section - Exit critical section
@@ -45,4 +94,82 @@ void enter_critical_section(void);
  */
 void exit_critical_section(void);
 
+/*
+ * thread_parker - Parking spot of a sleeping thread
+ *
+ * A thread sleeps on a parker with thread_park() until another thread releases
+ * it with thread_unpark(). Parkers never allocate and can live on the stack of
+ * the thread sleeping on them: the releasing thread is done with a parker as
+ * soon as its thread can run.
+ */
+struct thread_parker {
+	atomic_int parked;
+	struct thread_parker *next;
+};
+
+/*
+ * thread_parker_init - Prepare parker
+ * @parker: Parker to prepare
+ *
+ * Arm @parker, so that the next thread_park() on it sleeps until it is
+ * released. This must happen before @parker is made visible to the thread
+ * that is to release it.
+ */
+void thread_parker_init(struct thread_parker *parker);
+
+/*
+ * thread_park - Sleep on parker
+ * @parker: Parker armed with thread_parker_init()
+ *
+ * Block the current thread until @parker is released, or return right away if
+ * it already was.
+ */
+void thread_park(struct thread_parker *parker);
+
+/*
+ * thread_unpark - Release parker
+ * @parker: Parker to release
+ *
+ * Wake up the thread sleeping on @parker. If this function is called in a
+ * critical section, the wakeup is deferred until the caller has left the
+ * critical section, along with all the other wakeups (including those of
+ * thread_unblock()) issued meanwhile.
+ */
+void thread_unpark(struct thread_parker *parker);
+
+/*
+ * cs_profile_enable - Turn the critical section profiler on or off
+ * @enable: Whether to profile critical sections from now on
+ *
+ * While the profiler is on, every call site of enter_critical_section() counts
+ * how many times it entered the critical section, how long it waited to get in
+ * and how long it held it, with a histogram of each time (bucket i counts the
+ * times between 2^i and 2^(i+1) nanoseconds). Nested critical sections are
+ * accounted to the outermost one. When it is first turned on, the profiler
+ * arranges for a report to be printed on the standard error at exit.
+ */
+void cs_profile_enable(int enable);
+
+/*
+ * cs_profile_dump - Print critical section profile
+ * @fd: File descriptor to print to
+ *
+ * Print the profile of every call site that entered the critical section while
+ * the profiler was on. This only uses write() and doesn't take any lock, so it
+ * can be called from a signal handler, but numbers may be a little off if
+ * other threads are entering the critical section meanwhile.
+ */
+void cs_profile_dump(int fd);
+
+/*
+ * cs_profile_dump_on_signal - Print critical section profile on a signal
+ * @signo: Signal number
+ *
+ * Install a handler for signal @signo that prints the profile on the standard
+ * error, e.g. for SIGUSR1.
+ *
+ * Return: -1 if the handler could not be installed, 0 otherwise.
+ */
+int cs_profile_dump_on_signal(int signo);
+
 #endif /* _THREAD_H */
@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "timer.h"
+#include "util.h"
+
+// Life of a timer: armed in the wheel, then either cancelled, or taken out of
+// the wheel to fire and done once its function has returned
+enum {
+	TIMER_IDLE,
+	TIMER_ARMED,
+	TIMER_FIRING,
+	TIMER_FIRED,
+};
+
+// Each slot is a circular list headed by a dummy entry. Timers further away
+// than one turn of the wheel simply stay in their slot until their tick.
+static struct timer_entry wheel[TIMER_WHEEL_SLOTS];
+static size_t pending;
+// Last tick the wheel's thread has handled
+static uint64_t currentTick;
+
+static pthread_mutex_t wheelLock = PTHREAD_MUTEX_INITIALIZER;
+// The wheel's thread sleeps on `wakeup` while nothing is pending, and
+// timer_cancel() waits on `fired` for a running timer function to return
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fired = PTHREAD_COND_INITIALIZER;
+static pthread_once_t wheelOnce = PTHREAD_ONCE_INIT;
+static int wheelStarted;
+
+static uint64_t nowTick(void)
+{
+	return nowNs() / TIMER_TICK_NS;
+}
+
+static void unlinkTimer(struct timer_entry *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	pending--;
+}
+
+// Fire every timer of @slot that is due by @tick. The lock is dropped while a
+// function runs, so the scan starts over after each one.
+static void fireSlot(struct timer_entry *slot, uint64_t tick)
+{
+	struct timer_entry *timer = slot->next;
+	while (timer != slot) {
+		if (timer->expiry > tick) {
+			timer = timer->next;
+			continue;
+		}
+		unlinkTimer(timer);
+		timer->state = TIMER_FIRING;
+		pthread_mutex_unlock(&wheelLock);
+		timer->func(timer->arg);
+		pthread_mutex_lock(&wheelLock);
+		timer->state = TIMER_FIRED;
+		pthread_cond_broadcast(&fired);
+		timer = slot->next;
+	}
+}
+
+static void *wheelThread(__attribute__((unused)) void *arg)
+{
+	pthread_mutex_lock(&wheelLock);
+	while (1) {
+		while (pending == 0)
+			pthread_cond_wait(&wakeup, &wheelLock);
+
+		uint64_t tick = nowTick();
+		// After a long sleep, one pass over the whole wheel is enough
+		uint64_t from = currentTick + 1;
+		if (tick - currentTick > TIMER_WHEEL_SLOTS)
+			from = tick - TIMER_WHEEL_SLOTS + 1;
+		// Move on one tick at a time, so that timers armed by a function
+		// that fires land in a slot that is still ahead of us
+		for (uint64_t t = from; t <= tick; t++) {
+			currentTick = t;
+			fireSlot(&wheel[t % TIMER_WHEEL_SLOTS], tick);
+		}
+		currentTick = tick;
+
+		// Sleep until the next tick
+		struct timespec next;
+		uint64_t ns = (tick + 1) * TIMER_TICK_NS;
+		next.tv_sec = ns / 1000000000;
+		next.tv_nsec = ns % 1000000000;
+		pthread_mutex_unlock(&wheelLock);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		pthread_mutex_lock(&wheelLock);
+	}
+	return NULL;
+}
+
+static void startWheel(void)
+{
+	for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		wheel[i].next = wheel[i].prev = &wheel[i];
+	currentTick = nowTick();
+
+	// The wheel's thread lives as long as the process
+	pthread_t tid;
+	pthread_attr_t threadAttr;
+	pthread_attr_init(&threadAttr);
+	pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+	wheelStarted = pthread_create(&tid, &threadAttr, wheelThread, NULL) == 0;
+	pthread_attr_destroy(&threadAttr);
+}
+
+int timer_arm(struct timer_entry *timer, const struct timespec *deadline, timer_func_t func, void *arg)
+{
+	pthread_once(&wheelOnce, startWheel);
+	if (!wheelStarted) return -1;
+
+	// Round up, so that the timer never fires before its deadline
+	uint64_t ns = (uint64_t) deadline->tv_sec * 1000000000 + deadline->tv_nsec;
+	timer->expiry = (ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	timer->func = func;
+	timer->arg = arg;
+
+	pthread_mutex_lock(&wheelLock);
+	// Ticks the wheel is done with would never come around again
+	if (timer->expiry <= currentTick)
+		timer->expiry = currentTick + 1;
+	struct timer_entry *slot = &wheel[timer->expiry % TIMER_WHEEL_SLOTS];
+	timer->next = slot;
+	timer->prev = slot->prev;
+	slot->prev->next = timer;
+	slot->prev = timer;
+	timer->state = TIMER_ARMED;
+	if (pending++ == 0)
+		pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&wheelLock);
+	return 0;
+}
+
+int timer_cancel(struct timer_entry *timer)
+{
+	pthread_mutex_lock(&wheelLock);
+	if (timer->state == TIMER_ARMED) {
+		unlinkTimer(timer);
+		timer->state = TIMER_IDLE;
+		pthread_mutex_unlock(&wheelLock);
+		return 0;
+	}
+	while (timer->state == TIMER_FIRING)
+		pthread_cond_wait(&fired, &wheelLock);
+	timer->state = TIMER_IDLE;
+	pthread_mutex_unlock(&wheelLock);
+	return 1;
+}
@@ -0,0 +1,69 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Timer wheel
+ *
+ * All timers of the library share a single hashed timer wheel, driven by one
+ * background thread that only runs while timers are pending. The wheel has
+ * TIMER_WHEEL_SLOTS slots of TIMER_TICK_NS nanoseconds each: arming or
+ * cancelling a timer is O(1) however many are pending, and a tick only looks
+ * at the timers of one slot. Timers never fire early, but may fire up to a
+ * tick late.
+ *
+ * A timer is an intrusive record owned by its user, typically on the stack of
+ * a thread that waits with a deadline: the wheel never allocates memory.
+ * Callbacks run on the wheel's thread, one at a time.
+ */
+
+#define TIMER_TICK_NS		1000000
+#define TIMER_WHEEL_SLOTS	512
+
+typedef void (*timer_func_t)(void *arg);
+
+/*
+ * timer_entry - Timer record
+ *
+ * Opaque to the user, who only provides the memory for it. A timer must not be
+ * moved or freed while it is armed, i.e. until timer_cancel() returns.
+ */
+struct timer_entry {
+	struct timer_entry *next;
+	struct timer_entry *prev;
+	uint64_t expiry;
+	timer_func_t func;
+	void *arg;
+	int state;
+};
+
+/*
+ * timer_arm - Arm a timer
+ * @timer: Timer record
+ * @deadline: Absolute CLOCK_MONOTONIC time at which to fire
+ * @func: Function to call when the timer fires
+ * @arg: Argument to pass to @func
+ *
+ * Call @func(@arg) from the wheel's thread once @deadline has passed, unless
+ * the timer is cancelled first. A deadline in the past fires on the next tick.
+ *
+ * Return: -1 if the wheel's thread could not be started. 0 if the timer was
+ * armed.
+ */
+int timer_arm(struct timer_entry *timer, const struct timespec *deadline, timer_func_t func, void *arg);
+
+/*
+ * timer_cancel - Disarm a timer
+ * @timer: Timer record armed with timer_arm()
+ *
+ * Make sure that @timer's function is not running and will not run anymore,
+ * waiting for it to return if it is running right now. The caller must
+ * therefore not hold any lock that the function takes.
+ *
+ * Return: 1 if the timer had fired. 0 if it was cancelled before firing.
+ */
+int timer_cancel(struct timer_entry *timer);
+
+#endif /* _TIMER_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <pthread.h>
 #include <signal.h>
@@ -8,45 +9,424 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
-#include "queue.h"
+#include "pool.h"
 #include "thread.h"
 #include "tps.h"
+#include "trace.h"
+#include "util.h"
 
 
+// A page shared by a TPS and its clones. Its contents live at their place in
+// the range of the TPS it was first cloned from (the host), until the host
+// writes to it or goes away: the contents then move to a pool slot of their
+// own for the remaining clones.
 typedef struct Page {
 	char* addr;
 	int count;
 } Page;
 
+// A memfd whose contents are shared by a TPS and its clones (kernel
+// copy-on-write mode only)
+typedef struct Backing {
+	int fd;
+	int count;
+	size_t size;
+} Backing;
+
 typedef struct TPS {
-	Page* page;
 	pthread_t tid;
+	struct TPS* next;
+	// Address range of the TPS, `npages` pages long
+	char* addr;
+	size_t npages;
+	// Default mode: pages shared with clones, if any. A NULL entry means that
+	// the page is ours alone and that its contents are at its place in our
+	// range.
+	Page** pages;
+	// Set if the range is a single pool slot rather than a mapping of its own
+	int pooled;
+	// Kernel copy-on-write mode: backing file of the TPS, which `view` maps
+	// privately unless `shared` is set, meaning no clone maps the file and
+	// writes go through. `view` is where the API accesses the TPS: the range
+	// itself, except in double-mapped mode where it is a second, always
+	// accessible mapping that the range's PROT_NONE pages keep hidden.
+	Backing* backing;
+	char* view;
+	int shared;
+	// Set once the private mapping has pages the backing file doesn't have
+	int dirty;
+	// Access rights granted by the session opened with tps_map(), or 0
+	int session;
 } TPS;
 
-queue_t tpsQueue = NULL;
+static int tpsInitialized;
+static int tpsMode;
+
+// TPS areas indexed by the TID of the thread owning them, so that finding the
+// caller's TPS takes constant time however many areas are alive. Buckets are
+// chained through TPS.next and the table doubles once it holds more areas than
+// it has buckets.
+typedef struct TPSTable {
+	TPS** buckets;
+	size_t size;
+	size_t count;
+} TPSTable;
+
+#define TPS_TABLE_MIN_SIZE 64
+
+static TPSTable tpsTable;
+
+// Find TPS based on tid
+static TPS* findTps(pthread_t tid)
+{
+	if (tpsTable.buckets == NULL) return NULL;
+	TPS* tps = tpsTable.buckets[hashTid(tid) & (tpsTable.size - 1)];
+	while (tps != NULL && !pthread_equal(tps->tid, tid))
+		tps = tps->next;
+	return tps;
+}
 
-// Find TPS based on its page's starting address
-static int findTpsFromPageAddr(void *data, void* arg)
+static int growTpsTable(void)
 {
-	TPS* a = (TPS*)data;
-	void* match = arg;
-	if((void*) a->page->addr == match){
-		return 1;
+	size_t newSize = tpsTable.size ? tpsTable.size * 2 : TPS_TABLE_MIN_SIZE;
+	TPS** newBuckets = calloc(newSize, sizeof(TPS*));
+	if (newBuckets == NULL) return -1;
+
+	// Rehash every TPS into the new buckets
+	for (size_t i = 0; i < tpsTable.size; i++) {
+		TPS* tps = tpsTable.buckets[i];
+		while (tps != NULL) {
+			TPS* next = tps->next;
+			size_t bucket = hashTid(tps->tid) & (newSize - 1);
+			tps->next = newBuckets[bucket];
+			newBuckets[bucket] = tps;
+			tps = next;
+		}
 	}
+	free(tpsTable.buckets);
+	tpsTable.buckets = newBuckets;
+	tpsTable.size = newSize;
 	return 0;
 }
 
-// Find TPS based on tid
-static int findTpsFromTid(void *data, void *arg)
+static int addTps(TPS* tps)
 {
-    TPS *a = (TPS*)data;
-    int match = (int)(long) arg;
-    if ((int)(long) a->tid == match){
-        return 1;
-    }
-    return 0;
+	if (tpsTable.count >= tpsTable.size && growTpsTable() < 0) return -1;
+	size_t bucket = hashTid(tps->tid) & (tpsTable.size - 1);
+	tps->next = tpsTable.buckets[bucket];
+	tpsTable.buckets[bucket] = tps;
+	tpsTable.count++;
+	return 0;
+}
+
+static void removeTps(TPS* tps)
+{
+	TPS** link = &tpsTable.buckets[hashTid(tps->tid) & (tpsTable.size - 1)];
+	while (*link != tps)
+		link = &(*link)->next;
+	*link = tps->next;
+	tpsTable.count--;
+}
+
+// Number of pages needed to hold @size bytes
+static size_t sizeToPages(size_t size)
+{
+	return (size + TPS_SIZE - 1) / TPS_SIZE;
+}
+
+static size_t tpsBytes(TPS* tps)
+{
+	return tps->npages * TPS_SIZE;
+}
+
+// Place of page @i in the range of @tps
+static char* ownPage(TPS* tps, size_t i)
+{
+	return tps->addr + i * TPS_SIZE;
+}
+
+// Where the contents of page @i of @tps currently are
+static char* pageData(TPS* tps, size_t i)
+{
+	if (tpsMode & TPS_MODE_KERNEL_COW)
+		return tps->view + i * TPS_SIZE;
+	if (tps->pages[i] != NULL)
+		return tps->pages[i]->addr;
+	return ownPage(tps, i);
+}
+
+// Check that [@offset, @offset + @length) lies within the TPS
+static int inBounds(TPS* tps, size_t offset, size_t length)
+{
+	return length <= tpsBytes(tps) && offset <= tpsBytes(tps) - length;
+}
+
+// Find the TPS whose range contains @addr. Only used when reporting a fault,
+// so a full walk of the table is fine.
+static TPS* findTpsFromPageAddr(void* addr)
+{
+	for (size_t i = 0; i < tpsTable.size; i++) {
+		for (TPS* tps = tpsTable.buckets[i]; tps != NULL; tps = tps->next) {
+			if ((char*) addr >= tps->addr && (char*) addr < tps->addr + tpsBytes(tps))
+				return tps;
+		}
+	}
+	return NULL;
+}
+
+// Open up (or close down) TPS memory that the API is about to access (or is
+// done with). In double-mapped mode, the API's view is always accessible.
+static void setAccess(char* addr, size_t length, int prot)
+{
+	if (!(tpsMode & TPS_MODE_DOUBLE_MAP))
+		mprotect(addr, length, prot);
+}
+
+// Access rights of a view while nothing is being read or written
+static int viewProt(void)
+{
+	return (tpsMode & TPS_MODE_DOUBLE_MAP) ? PROT_READ | PROT_WRITE : PROT_NONE;
+}
+
+// Map a range of @npages for a new TPS, from the pool when a single page is
+// enough
+static char* mapRange(size_t npages, int* pooled)
+{
+	*pooled = npages == 1;
+	if (*pooled)
+		return pool_alloc();
+
+	char* addr = mmap(NULL, npages * TPS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void unmapRange(TPS* tps)
+{
+	if (tps->pooled)
+		pool_free(tps->addr);
+	else
+		munmap(tps->addr, tpsBytes(tps));
+}
+
+// Copy a page's contents, opening up both pages for the duration of the copy
+static void copyPage(char* dst, char* src)
+{
+	TRACE_BEGIN("tps_cow_copy", "page", src);
+	mprotect(src, TPS_SIZE, PROT_READ);
+	mprotect(dst, TPS_SIZE, PROT_WRITE);
+	memcpy(dst, src, TPS_SIZE);
+	mprotect(dst, TPS_SIZE, PROT_NONE);
+	mprotect(src, TPS_SIZE, PROT_NONE);
+	TRACE_END("tps_cow_copy");
+}
+
+// Stop sharing page @i of @tps with its clones. If @keep is set, the contents
+// of the page end up at its place in our range, otherwise they are lost to us.
+// The clones keep the contents either way.
+static int detachPage(TPS* tps, size_t i, int keep)
+{
+	Page* page = tps->pages[i];
+	if (page == NULL) return 0;
+
+	char* own = ownPage(tps, i);
+	if (page->addr == own) {
+		// We host the page: the clones still need it, so move it out of our way
+		if (page->count > 1) {
+			char* slot = pool_alloc();
+			if (slot == NULL) return -1;
+			copyPage(slot, own);
+			page->addr = slot;
+		}
+	} else if (keep) {
+		copyPage(own, page->addr);
+	}
+
+	// The last one out frees the page, and its slot if it had moved to one
+	if (--page->count == 0) {
+		if (page->addr != own)
+			pool_free(page->addr);
+		free(page);
+	}
+	tps->pages[i] = NULL;
+	return 0;
+}
+
+// Give the TPS its own copy of every shared page in [@offset, @offset + @length),
+// before it writes @length bytes there. A page that is about to be entirely
+// overwritten isn't worth copying.
+static int detachPages(TPS* tps, size_t offset, size_t length)
+{
+	if (tps->pages == NULL || length == 0) return 0;
+
+	for (size_t i = offset / TPS_SIZE; i <= (offset + length - 1) / TPS_SIZE; i++) {
+		int whole = offset <= i * TPS_SIZE && offset + length >= (i + 1) * TPS_SIZE;
+		if (detachPage(tps, i, !whole) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static Backing* newBacking(size_t size)
+{
+	Backing* backing = malloc(sizeof(Backing));
+	if (backing == NULL) return NULL;
+	backing->fd = memfd_create("tps", MFD_CLOEXEC);
+	if (backing->fd < 0 || ftruncate(backing->fd, size) < 0) {
+		if (backing->fd >= 0) close(backing->fd);
+		free(backing);
+		return NULL;
+	}
+	backing->count = 1;
+	backing->size = size;
+	return backing;
+}
+
+static void releaseBacking(Backing* backing)
+{
+	if (--backing->count == 0) {
+		close(backing->fd);
+		free(backing);
+	}
+}
+
+// Map @size bytes of @backing, either shared (writes go to the file) or
+// private (the kernel copies a page on its first write). If @addr is not NULL,
+// the new mapping replaces whatever is mapped there.
+static char* mapBacking(char* addr, size_t size, Backing* backing, int shared, int prot)
+{
+	int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | (addr != NULL ? MAP_FIXED : 0);
+	char* mapped = mmap(addr, size, prot, flags, backing->fd, 0);
+	return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+// Map the view and the range of a TPS whose backing file is already set up.
+// The range is mapped last, so that it is the last mapping made for a TPS.
+static int mapViews(TPS* tps)
+{
+	tps->view = mapBacking(NULL, tpsBytes(tps), tps->backing, tps->shared, viewProt());
+	if (tps->view == NULL) return -1;
+	if (!(tpsMode & TPS_MODE_DOUBLE_MAP)) {
+		tps->addr = tps->view;
+		return 0;
+	}
+
+	// The range only ever traps stray accesses, so it doesn't matter that it
+	// doesn't see our private changes
+	tps->addr = mapBacking(NULL, tpsBytes(tps), tps->backing, 1, PROT_NONE);
+	if (tps->addr == NULL) {
+		munmap(tps->view, tpsBytes(tps));
+		return -1;
+	}
+	return 0;
+}
+
+static void unmapViews(TPS* tps)
+{
+	munmap(tps->view, tpsBytes(tps));
+	if (tpsMode & TPS_MODE_DOUBLE_MAP)
+		munmap(tps->addr, tpsBytes(tps));
+}
+
+// Access rights the view of @tps keeps between two API calls
+static int restingProt(TPS* tps)
+{
+	return tps->session ? tps->session : viewProt();
+}
+
+// Make sure the backing file of @tps holds exactly its current contents, and
+// that @tps maps it privately, so that clones can map the same file
+static int freezeTps(TPS* tps)
+{
+	if (tps->shared) {
+		// Writes went straight to the file, which is therefore up to date
+		if (mapBacking(tps->view, tpsBytes(tps), tps->backing, 0, restingProt(tps)) == NULL) return -1;
+		tps->shared = 0;
+	} else if (tps->dirty) {
+		// Some pages only exist in our private mapping: snapshot them into a
+		// new file
+		Backing* backing = newBacking(tpsBytes(tps));
+		if (backing == NULL) return -1;
+		int prot = restingProt(tps);
+		setAccess(tps->view, tpsBytes(tps), prot | PROT_READ);
+		ssize_t copied = pwrite(backing->fd, tps->view, tpsBytes(tps), 0);
+		setAccess(tps->view, tpsBytes(tps), prot);
+		if (copied != (ssize_t) tpsBytes(tps) || mapBacking(tps->view, tpsBytes(tps), backing, 0, prot) == NULL) {
+			releaseBacking(backing);
+			return -1;
+		}
+		// Let go of the old file in the range as well
+		if (tpsMode & TPS_MODE_DOUBLE_MAP)
+			mapBacking(tps->addr, tpsBytes(tps), backing, 1, PROT_NONE);
+		releaseBacking(tps->backing);
+		tps->backing = backing;
+	}
+	tps->dirty = 0;
+	return 0;
 }
 
+// Number of pages from page @first whose contents sit next to each other,
+// stopping at page @last
+static size_t pageRun(TPS* tps, size_t first, size_t last)
+{
+	char* start = pageData(tps, first);
+	size_t i = first;
+	while (i < last && pageData(tps, i + 1) == start + (i + 1 - first) * TPS_SIZE)
+		i++;
+	return i + 1 - first;
+}
+
+// Set the access rights of pages @first to @last of the TPS. Protection is
+// changed once per run of pages whose contents sit next to each other, which is
+// the whole span unless some pages are shared.
+static void setPagesAccess(TPS* tps, size_t first, size_t last, int prot)
+{
+	while (first <= last) {
+		size_t run = pageRun(tps, first, last);
+		setAccess(pageData(tps, first), run * TPS_SIZE, prot);
+		first += run;
+	}
+}
+
+// Copy @length bytes between @buffer and the TPS at @offset, in either
+// direction, once the pages involved are accessible
+static void moveData(TPS* tps, size_t offset, size_t length, char* buffer, int write)
+{
+	while (length > 0) {
+		size_t first = offset / TPS_SIZE;
+		size_t run = pageRun(tps, first, (offset + length - 1) / TPS_SIZE);
+		size_t chunk = (first + run) * TPS_SIZE - offset;
+		if (chunk > length) chunk = length;
+		char* data = pageData(tps, first) + (offset - first * TPS_SIZE);
+
+		if (write)
+			memcpy(data, buffer, chunk);
+		else
+			memcpy(buffer, data, chunk);
+
+		offset += chunk;
+		buffer += chunk;
+		length -= chunk;
+	}
+}
+
+// Copy @length bytes between @buffer and the TPS at @offset, in either
+// direction, lifting protection just around the copy
+static void copyTps(TPS* tps, size_t offset, size_t length, char* buffer, int write)
+{
+	if (length == 0) return;
+	size_t first = offset / TPS_SIZE;
+	size_t last = (offset + length - 1) / TPS_SIZE;
+
+	setPagesAccess(tps, first, last, write ? PROT_WRITE : PROT_READ);
+	moveData(tps, offset, length, buffer, write);
+	setPagesAccess(tps, first, last, PROT_NONE);
+}
+
+/*
+ * In kernel copy-on-write mode, the first write to a page of a private mapping
+ * is resolved by the kernel itself and never raises a signal: only accesses to
+ * a TPS outside of the API (i.e. to a PROT_NONE page) end up here.
+ */
 static void segv_handler(int sig, siginfo_t *si, __attribute__((unused)) void *context)
 {
     /*
@@ -55,8 +435,7 @@ static void segv_handler(int sig, siginfo_t *si, __attribute__((unused)) void *c
      */
     void* p_fault = (void*)((uintptr_t)si->si_addr & ~(TPS_SIZE - 1));
 
-	TPS* foundTPS = NULL;
-	queue_iterate(tpsQueue, findTpsFromPageAddr, (void*) p_fault, (void**) &foundTPS);
+	TPS* foundTPS = findTpsFromPageAddr(p_fault);
 
     if (foundTPS != NULL)
         /* Printf the following error message */
@@ -71,6 +450,18 @@ static void segv_handler(int sig, siginfo_t *si, __attribute__((unused)) void *c
 
 int tps_init(int segv)
 {
+	return tps_init_mode(segv, TPS_MODE_DEFAULT);
+}
+
+int tps_init_mode(int segv, int mode)
+{
+	if (tpsInitialized || (mode & ~(TPS_MODE_KERNEL_COW | TPS_MODE_DOUBLE_MAP))) return -1;
+	tpsInitialized = 1;
+	// The double mapping is built on the memfd backing
+	if (mode & TPS_MODE_DOUBLE_MAP)
+		mode |= TPS_MODE_KERNEL_COW;
+	tpsMode = mode;
+
 	if (segv) {
 		struct sigaction sa;
 
@@ -83,53 +474,77 @@ int tps_init(int segv)
 	return 0;
 }
 
-int tps_create(void)
+// Give a new TPS its range, in whichever way the mode wants it
+static int mapNewTps(TPS* tps)
 {
-	enter_critical_section();
-	// Initialize tpsQueue if it hasn't been already
-	if(tpsQueue == NULL) {
-		tpsQueue = queue_create();
-		if (tpsQueue == NULL) {
-			exit_critical_section();
+	if (tpsMode & TPS_MODE_KERNEL_COW) {
+		tps->pages = NULL;
+		tps->pooled = 0;
+		tps->backing = newBacking(tpsBytes(tps));
+		if (tps->backing == NULL) return -1;
+
+		// Nobody else uses the file yet, so map it shared
+		tps->shared = 1;
+		tps->dirty = 0;
+		if (mapViews(tps) < 0) {
+			releaseBacking(tps->backing);
 			return -1;
 		}
+		return 0;
 	}
-	exit_critical_section();
 
-	// Attempt to find thread's current TPS
-	TPS* foundTPS = NULL;
-	enter_critical_section();
-	if (queue_iterate(tpsQueue, findTpsFromTid, (void*) pthread_self(), (void**) &foundTPS) < 0) {
-		exit_critical_section();
+	tps->backing = NULL;
+	tps->pages = calloc(tps->npages, sizeof(Page*));
+	if (tps->pages == NULL) return -1;
+	tps->addr = mapRange(tps->npages, &tps->pooled);
+	if (tps->addr == NULL) {
+		free(tps->pages);
 		return -1;
 	}
+	return 0;
+}
+
+int tps_create(void)
+{
+	return tps_create_sized(TPS_SIZE);
+}
+
+int tps_create_sized(size_t size)
+{
+	if (size == 0) return -1;
+
+	enter_critical_section();
 	// If the current thread already has a TPS, error
-	if (foundTPS != NULL) {
+	if (findTps(pthread_self()) != NULL) {
 		exit_critical_section();
 		return -1;
 	}
-	exit_critical_section();
 
-	// Allocate and initialize page for TPS
-	void* pageAddr = mmap(NULL, TPS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
-	if (pageAddr == (void*) -1) return -1;
-
-	Page* newPage = malloc(sizeof(Page));
-	newPage->addr = pageAddr;
-	newPage->count = 1;
-
-	// Allocate and initialize new TPS
-	TPS* newTPS = malloc(sizeof(TPS));
-	newTPS->page = newPage;
+	// Allocate and initialize new TPS, with zeroed pages
+	TPS* newTPS = calloc(1, sizeof(TPS));
+	if (newTPS == NULL) {
+		exit_critical_section();
+		return -1;
+	}
 	newTPS->tid = pthread_self();
+	newTPS->npages = sizeToPages(size);
+	newTPS->session = 0;
+	if (mapNewTps(newTPS) < 0) {
+		exit_critical_section();
+		free(newTPS);
+		return -1;
+	}
 
-	// Add new TPS to queue	
-	enter_critical_section();
-	if (queue_enqueue(tpsQueue, newTPS) < 0) {
+	// Add it to the table
+	if (addTps(newTPS) < 0) {
+		unmapRange(newTPS);
 		exit_critical_section();
+		free(newTPS->pages);
+		free(newTPS);
 		return -1;
 	}
 	exit_critical_section();
+	TRACE_INSTANT("tps_create", "size", size);
 
 	return 0;
 }
@@ -137,60 +552,77 @@ int tps_create(void)
 int tps_destroy(void)
 {
 	// Find the thread's TPS
-	TPS* foundTPS = NULL;
 	enter_critical_section();
-	if (queue_iterate(tpsQueue, findTpsFromTid, (void*) pthread_self(), (void**) &foundTPS) < 0) {
-		exit_critical_section();
-		return -1;
-	}
+	TPS* foundTPS = findTps(pthread_self());
 
-	// If the thread has no TPS, error
-	if(foundTPS == NULL) {
+	// If the thread has no TPS, or is using it through tps_map(), error
+	if (foundTPS == NULL || foundTPS->session) {
 		exit_critical_section();
 		return -1;
 	}
 
-	// If the thread's TPS is not the only one using the page it refers to, the just decrement the count on the page
-	if (foundTPS->page->count > 1) {
-		foundTPS->page->count--;
-	}
-	// If the thread's TPS is the only one using the page it refers to, then we can delete the page
-	else {
-		munmap(foundTPS->page->addr, TPS_SIZE);
-		free(foundTPS->page);
-		free(foundTPS);
+	if (tpsMode & TPS_MODE_KERNEL_COW) {
+		// The file goes away with the last mapping of it
+		unmapViews(foundTPS);
+		releaseBacking(foundTPS->backing);
+	} else {
+		// Pages still used by clones are handed over to them before our
+		// range goes away
+		for (size_t i = 0; i < foundTPS->npages; i++) {
+			if (detachPage(foundTPS, i, 0) < 0) {
+				exit_critical_section();
+				return -1;
+			}
+		}
+		unmapRange(foundTPS);
+		free(foundTPS->pages);
 	}
 
-	// Delete the TPS either way
-	queue_delete(tpsQueue, foundTPS);
+	// Delete the TPS
+	removeTps(foundTPS);
+	free(foundTPS);
 	exit_critical_section();
 
 	return 0;
 }
 
+// Get the TPS ready to have [@offset, @offset + @length) written to
+static int prepareWrite(TPS* tps, size_t offset, size_t length)
+{
+	if (tpsMode & TPS_MODE_KERNEL_COW) {
+		// Once all clones are gone and we haven't written privately yet, the
+		// file is ours alone: write through to it and spare the kernel the copy
+		if (!tps->shared && !tps->dirty && tps->backing->count == 1) {
+			if (mapBacking(tps->view, tpsBytes(tps), tps->backing, 1, viewProt()) != NULL)
+				tps->shared = 1;
+		}
+		// Otherwise the kernel copies each page we write to for the first time
+		if (!tps->shared)
+			tps->dirty = 1;
+		return 0;
+	}
+	// If some of the pages we write to are shared with other TPSs, we first
+	// need our own copy of them, leaving the others with the original ones
+	return detachPages(tps, offset, length);
+}
+
 int tps_read(size_t offset, size_t length, void *buffer)
 {
 	// Buffer can't be NULL
 	if (buffer == NULL) return -1;
 
 	// Find thread's TPS to read from
-	TPS* foundTPS = NULL;
 	enter_critical_section();
-	if (queue_iterate(tpsQueue, findTpsFromTid, (void*) pthread_self(), (void**) &foundTPS) < 0) {
-		exit_critical_section();
-		return -1;
-	}
+	TPS* foundTPS = findTps(pthread_self());
 
-	// If no TPS is found, error
-	if (foundTPS == NULL) {
+	// If no TPS is found, or if it is mapped, or if the read is out of bound, error
+	if (foundTPS == NULL || foundTPS->session || !inBounds(foundTPS, offset, length)) {
 		exit_critical_section();
 		return -1;
 	}
 
 	// Allow reading, read, then disable reading
-	mprotect(foundTPS->page->addr, length, PROT_READ);
-	memcpy(buffer, foundTPS->page->addr + offset, length);
-	mprotect(foundTPS->page->addr, length, PROT_NONE);
+	copyTps(foundTPS, offset, length, buffer, 0);
 	exit_critical_section();
 
 	return 0;
@@ -201,83 +633,411 @@ int tps_write(size_t offset, size_t length, void *buffer)
 	if (buffer == NULL) return -1;
 
 	// Find TPS
-	TPS* foundTPS = NULL;
 	enter_critical_section();
-	if (queue_iterate(tpsQueue, findTpsFromTid, (void*) pthread_self(), (void**) &foundTPS) < 0) {
+	TPS* foundTPS = findTps(pthread_self());
+
+	// If no TPS is found, or if it is mapped, or if the write is out of bound, error
+	if (foundTPS == NULL || foundTPS->session || !inBounds(foundTPS, offset, length)) {
 		exit_critical_section();
 		return -1;
 	}
 
-	// If no TPS is found, error
-	if (foundTPS == NULL) {
+	if (prepareWrite(foundTPS, offset, length) < 0) {
 		exit_critical_section();
 		return -1;
 	}
-	
-	// If there are multiple TPSs that are using the page this thread's TPS is associated with,
-	// we have to make a new page, copy the data from the old page to the new one and then decrement
-	// the count of the old page
-	if (foundTPS->page->count > 1) {
-		// Allocate page for TPS
-		void* pageAddr = mmap(NULL, TPS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-		if (pageAddr == (void*) -1) return -1;
-		Page* newPage = malloc(sizeof(Page));
-		newPage->addr = pageAddr;
-		newPage->count = 1;
-		// Allow reading and writing
-		mprotect(foundTPS->page->addr, length, PROT_WRITE | PROT_READ);
-		// Copy data from old page to the new one
-		memcpy(newPage->addr, foundTPS->page->addr, TPS_SIZE);
-		foundTPS->page->count--;
-		foundTPS->page = newPage;
-	}
-	
-	// Write new data to the new page
-	mprotect(foundTPS->page->addr, length, PROT_WRITE);
-	memcpy(foundTPS->page->addr + offset, buffer, length);
-	mprotect(foundTPS->page->addr, length, PROT_NONE);
+
+	// Write new data to the TPS
+	copyTps(foundTPS, offset, length, buffer, 1);
 	exit_critical_section();
 	return 0;
 }
 
-int tps_clone(pthread_t tid)
+// Check every segment of a vectored access before any data moves
+static int segmentsValid(TPS* tps, const tps_segment_t *segments, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (segments[i].buffer == NULL || !inBounds(tps, segments[i].offset, segments[i].length))
+			return 0;
+	}
+	return 1;
+}
+
+// Carry out a vectored read or write under a single lookup, with protection
+// lifted once over the span of pages that the segments cover
+static int accessSegments(const tps_segment_t *segments, size_t count, int write)
 {
+	if (segments == NULL && count > 0) return -1;
 
-	// Attempt to find thread's current TPS
-	TPS* curTPS = NULL;
 	enter_critical_section();
-	if (queue_iterate(tpsQueue, findTpsFromTid, (void*) pthread_self(), (void**) &curTPS) < 0) {
+	TPS* foundTPS = findTps(pthread_self());
+	if (foundTPS == NULL || foundTPS->session || !segmentsValid(foundTPS, segments, count)) {
 		exit_critical_section();
 		return -1;
 	}
-	// If the current thread already has a TPS, error
-	if (curTPS != NULL) {
+
+	size_t first = foundTPS->npages;
+	size_t last = 0;
+	for (size_t i = 0; i < count; i++) {
+		const tps_segment_t *seg = &segments[i];
+		if (seg->length == 0) continue;
+		if (write && prepareWrite(foundTPS, seg->offset, seg->length) < 0) {
+			exit_critical_section();
+			return -1;
+		}
+		if (seg->offset / TPS_SIZE < first)
+			first = seg->offset / TPS_SIZE;
+		if ((seg->offset + seg->length - 1) / TPS_SIZE > last)
+			last = (seg->offset + seg->length - 1) / TPS_SIZE;
+	}
+
+	// Nothing to move
+	if (first > last) {
+		exit_critical_section();
+		return 0;
+	}
+
+	setPagesAccess(foundTPS, first, last, write ? PROT_WRITE : PROT_READ);
+	for (size_t i = 0; i < count; i++)
+		moveData(foundTPS, segments[i].offset, segments[i].length, segments[i].buffer, write);
+	setPagesAccess(foundTPS, first, last, PROT_NONE);
+	exit_critical_section();
+	return 0;
+}
+
+int tps_readv(const tps_segment_t *segments, size_t count)
+{
+	return accessSegments(segments, count, 0);
+}
+
+int tps_writev(const tps_segment_t *segments, size_t count)
+{
+	return accessSegments(segments, count, 1);
+}
+
+void *tps_map(int mode)
+{
+	if (mode != TPS_MAP_READ && mode != TPS_MAP_WRITE) return NULL;
+
+	enter_critical_section();
+	TPS* foundTPS = findTps(pthread_self());
+	if (foundTPS == NULL || foundTPS->session) {
+		exit_critical_section();
+		return NULL;
+	}
+
+	// The TPS needs its own copy of every page, in a single piece: pages that
+	// we share would sit elsewhere in memory, and pages that we host would
+	// have their protection changed by our clones. Kernel copy-on-write mode
+	// has neither issue, so it only has to note down that we write.
+	if (tpsMode & TPS_MODE_KERNEL_COW) {
+		if (mode == TPS_MAP_WRITE)
+			prepareWrite(foundTPS, 0, tpsBytes(foundTPS));
+	} else {
+		for (size_t i = 0; i < foundTPS->npages; i++) {
+			if (detachPage(foundTPS, i, 1) < 0) {
+				exit_critical_section();
+				return NULL;
+			}
+		}
+	}
+
+	char* data = pageData(foundTPS, 0);
+	foundTPS->session = mode == TPS_MAP_WRITE ? PROT_READ | PROT_WRITE : PROT_READ;
+	setAccess(data, tpsBytes(foundTPS), foundTPS->session);
+#ifdef MADV_POPULATE_WRITE
+	// Have the kernel copy the pages it shares with our clones now rather
+	// than on the first write to each of them during the session
+	if (mode == TPS_MAP_WRITE && (tpsMode & TPS_MODE_KERNEL_COW) && !foundTPS->shared)
+		madvise(data, tpsBytes(foundTPS), MADV_POPULATE_WRITE);
+#endif
+	exit_critical_section();
+	return data;
+}
+
+int tps_unmap(void)
+{
+	enter_critical_section();
+	TPS* foundTPS = findTps(pthread_self());
+	if (foundTPS == NULL || !foundTPS->session) {
 		exit_critical_section();
 		return -1;
 	}
+
+	setAccess(pageData(foundTPS, 0), tpsBytes(foundTPS), PROT_NONE);
+	foundTPS->session = 0;
 	exit_critical_section();
+	return 0;
+}
 
-	// Find TPS with given tid
-	TPS* foundTPS = NULL;
+// Share every page of @source with the new TPS
+static int sharePages(TPS* newTPS, TPS* source)
+{
+	// Pages the source doesn't share yet become pages it hosts. Doing that
+	// for all of them first leaves nothing to undo if we run out of memory.
+	for (size_t i = 0; i < source->npages; i++) {
+		if (source->pages[i] == NULL) {
+			Page* page = malloc(sizeof(Page));
+			if (page == NULL) return -1;
+			page->addr = ownPage(source, i);
+			page->count = 1;
+			source->pages[i] = page;
+		}
+	}
+
+	for (size_t i = 0; i < source->npages; i++) {
+		source->pages[i]->count++;
+		newTPS->pages[i] = source->pages[i];
+	}
+	return 0;
+}
+
+int tps_clone(pthread_t tid)
+{
 	enter_critical_section();
-	if (queue_iterate(tpsQueue, findTpsFromTid, (void*) tid, (void**) &foundTPS) < 0) {
+	// If the current thread already has a TPS, error
+	if (findTps(pthread_self()) != NULL) {
+		exit_critical_section();
 		return -1;
 	}
-	
-	// If the TPS doesn't exist, error
-	if (foundTPS == NULL) {
+
+	// Find TPS with given tid
+	TPS* foundTPS = findTps(tid);
+
+	// If the TPS doesn't exist, or if its owner is using it through tps_map()
+	// (its contents may be changing, and sharing pages would change their
+	// protection under it), error
+	if (foundTPS == NULL || foundTPS->session) {
 		exit_critical_section();
 		return -1;
 	}
 
-	// Allocate a new TPS whose page is the same one as the TPS with the given tid
-	// and increment the page's count
-	TPS* newTPS = malloc(sizeof(TPS));
-	newTPS->page = foundTPS->page;
+	TPS* newTPS = calloc(1, sizeof(TPS));
+	if (newTPS == NULL) {
+		exit_critical_section();
+		return -1;
+	}
 	newTPS->tid = pthread_self();
-	newTPS->page->count++;
-	queue_enqueue(tpsQueue, newTPS);
+	newTPS->npages = foundTPS->npages;
+	newTPS->session = 0;
+
+	if (tpsMode & TPS_MODE_KERNEL_COW) {
+		// Both TPSs end up mapping the same file privately, so no data is
+		// copied until either of them writes to a page
+		newTPS->pages = NULL;
+		newTPS->pooled = 0;
+		newTPS->shared = 0;
+		newTPS->dirty = 0;
+		if (freezeTps(foundTPS) < 0) {
+			exit_critical_section();
+			free(newTPS);
+			return -1;
+		}
+		// Freezing may have given the source a new file
+		newTPS->backing = foundTPS->backing;
+		if (mapViews(newTPS) < 0) {
+			exit_critical_section();
+			free(newTPS);
+			return -1;
+		}
+		newTPS->backing->count++;
+	} else {
+		// The new TPS gets a range of its own, but refers to the pages of the
+		// TPS with the given tid until it writes to them
+		if (mapNewTps(newTPS) < 0) {
+			exit_critical_section();
+			free(newTPS);
+			return -1;
+		}
+		if (sharePages(newTPS, foundTPS) < 0) {
+			unmapRange(newTPS);
+			exit_critical_section();
+			free(newTPS->pages);
+			free(newTPS);
+			return -1;
+		}
+	}
+
+	if (addTps(newTPS) < 0) {
+		// Undoing is just like destroying the clone
+		if (tpsMode & TPS_MODE_KERNEL_COW) {
+			unmapViews(newTPS);
+			releaseBacking(newTPS->backing);
+		} else {
+			for (size_t i = 0; i < newTPS->npages; i++)
+				detachPage(newTPS, i, 0);
+			unmapRange(newTPS);
+			free(newTPS->pages);
+		}
+		exit_critical_section();
+		free(newTPS);
+		return -1;
+	}
 	exit_critical_section();
+	TRACE_INSTANT("tps_clone", "tid", tid);
+	return 0;
+}
+
+// Grow the mapping at @addr from @oldBytes to @newBytes without copying its
+// pages. mremap() can only do that in one go while the mapping is a single
+// kernel mapping, which protection changes and earlier moves may have split up:
+// otherwise, the pages are moved one by one to the start of a fresh mapping of
+// @backing (anonymous memory if NULL) with the same @shared and @prot. If a
+// move fails, the pages moved so far go back where they were, so that the
+// mapping at @addr is left as it was.
+static char* growMapping(char* addr, size_t oldBytes, size_t newBytes, Backing* backing, int shared, int prot)
+{
+	char* moved = mremap(addr, oldBytes, newBytes, MREMAP_MAYMOVE);
+	if (moved != MAP_FAILED) return moved;
+
+	char* dest;
+	if (backing != NULL) {
+		dest = mapBacking(NULL, newBytes, backing, shared, prot);
+	} else {
+		dest = mmap(NULL, newBytes, prot, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (dest == MAP_FAILED) dest = NULL;
+	}
+	if (dest == NULL) return NULL;
+
+	size_t offset;
+	for (offset = 0; offset < oldBytes; offset += TPS_SIZE) {
+		if (mremap(addr + offset, TPS_SIZE, TPS_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, dest + offset) == MAP_FAILED)
+			break;
+	}
+	if (offset == oldBytes) return dest;
+
+	while (offset > 0) {
+		offset -= TPS_SIZE;
+		mremap(dest + offset, TPS_SIZE, TPS_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, addr + offset);
+	}
+	munmap(dest, newBytes);
+	return NULL;
+}
+
+// Resize the range of @tps in the default mode
+static int resizeRange(TPS* tps, size_t npages)
+{
+	size_t oldBytes = tpsBytes(tps);
+	size_t newBytes = npages * TPS_SIZE;
+
+	// Pages we lose are handed over to our clones first
+	for (size_t i = npages; i < tps->npages; i++) {
+		if (detachPage(tps, i, 0) < 0)
+			return -1;
+	}
+
+	if (newBytes < oldBytes) {
+		munmap(tps->addr + newBytes, oldBytes - newBytes);
+		tps->npages = npages;
+		return 0;
+	}
+
+	Page** pages = realloc(tps->pages, npages * sizeof(Page*));
+	if (pages == NULL) return -1;
+	for (size_t i = tps->npages; i < npages; i++)
+		pages[i] = NULL;
+	tps->pages = pages;
+
+	char* addr;
+	if (tps->pooled)
+		addr = pool_grow(tps->addr, newBytes);
+	else
+		addr = growMapping(tps->addr, oldBytes, newBytes, NULL, 0, PROT_NONE);
+	if (addr == NULL) return -1;
+
+	// Pages we host for clones moved along with our range
+	for (size_t i = 0; i < tps->npages; i++) {
+		if (pages[i] != NULL && pages[i]->addr == ownPage(tps, i))
+			pages[i]->addr = addr + i * TPS_SIZE;
+	}
+	tps->addr = addr;
+	tps->pooled = 0;
+	tps->npages = npages;
 	return 0;
 }
 
+// Resize the mapping of @tps in kernel copy-on-write mode
+static int resizeMapping(TPS* tps, size_t npages)
+{
+	size_t oldBytes = tpsBytes(tps);
+	size_t newBytes = npages * TPS_SIZE;
+	Backing* backing = tps->backing;
+
+	// A file only we use can simply follow our size. A file shared with
+	// clones only ever grows, as they may still map its end.
+	if (backing->count == 1 || newBytes > backing->size) {
+		if (ftruncate(backing->fd, newBytes) < 0)
+			return -1;
+		backing->size = newBytes;
+	}
+
+	int doubleMapped = tpsMode & TPS_MODE_DOUBLE_MAP;
+	if (newBytes < oldBytes) {
+		munmap(tps->view + newBytes, oldBytes - newBytes);
+		if (doubleMapped)
+			munmap(tps->addr + newBytes, oldBytes - newBytes);
+		tps->npages = npages;
+		return 0;
+	}
+
+	char* view = growMapping(tps->view, oldBytes, newBytes, backing, tps->shared, viewProt());
+	if (view == NULL) return -1;
+	char* addr = view;
+	if (doubleMapped) {
+		addr = growMapping(tps->addr, oldBytes, newBytes, backing, 1, PROT_NONE);
+		if (addr == NULL) {
+			munmap(view + oldBytes, newBytes - oldBytes);
+			tps->view = view;
+			return -1;
+		}
+	}
+	tps->view = view;
+	tps->addr = addr;
+	tps->npages = npages;
+
+	// The end of a file shared with clones may still hold data from before
+	// an earlier shrink, while grown pages have to read back as zeros
+	if (backing->count > 1) {
+		setAccess(view + oldBytes, newBytes - oldBytes, PROT_WRITE);
+		memset(view + oldBytes, 0, newBytes - oldBytes);
+		setAccess(view + oldBytes, newBytes - oldBytes, PROT_NONE);
+		if (!tps->shared)
+			tps->dirty = 1;
+	}
+	return 0;
+}
+
+int tps_resize(size_t size)
+{
+	if (size == 0) return -1;
+
+	enter_critical_section();
+	TPS* foundTPS = findTps(pthread_self());
+	// A mapped TPS can't move
+	if (foundTPS == NULL || foundTPS->session) {
+		exit_critical_section();
+		return -1;
+	}
+
+	size_t npages = sizeToPages(size);
+	int ret = 0;
+	if (npages != foundTPS->npages) {
+		if (tpsMode & TPS_MODE_KERNEL_COW)
+			ret = resizeMapping(foundTPS, npages);
+		else
+			ret = resizeRange(foundTPS, npages);
+	}
+	exit_critical_section();
+	return ret;
+}
+
+int tps_reserve(size_t count)
+{
+	// Only the default mode allocates from the pool
+	if (tpsMode & TPS_MODE_KERNEL_COW) return 0;
+
+	enter_critical_section();
+	int ret = pool_reserve(count);
+	exit_critical_section();
+	return ret;
+}
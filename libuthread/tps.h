@@ -6,7 +6,8 @@
 #include <sys/types.h>
 
 /*
- * Size of a TPS area in bytes
+ * Size of a TPS area in bytes, unless created with tps_create_sized(). This is
+ * also the size of a TPS page: larger TPS areas are made of several pages.
  */
 #define TPS_SIZE 4096
 
@@ -24,6 +25,45 @@
  */
 int tps_init(int segv);
 
+/*
+ * TPS modes
+ *
+ * TPS_MODE_DEFAULT: TPS pages come from a pool of anonymous memory. A clone
+ * shares its source's page, and the first of the two to write to it gets a
+ * copy of the whole page, made by the TPS API.
+ *
+ * TPS_MODE_KERNEL_COW: every TPS is backed by its own memory file (memfd). A
+ * clone maps its source's file privately, so that cloning copies nothing and
+ * the kernel only duplicates the pages that either side later writes to. Each
+ * file holds a file descriptor for as long as a TPS maps it, so the process's
+ * limit on open files (RLIMIT_NOFILE, often 1024) also caps the number of TPS
+ * areas that can be alive at once: tps_create() fails beyond it.
+ *
+ * TPS_MODE_DOUBLE_MAP: kernel copy-on-write mode where every TPS file is mapped
+ * twice. The address range of the TPS stays PROT_NONE for good and only serves
+ * to catch stray accesses, while the TPS API reads and writes through a second,
+ * always accessible mapping that it never hands out. Accesses through the API
+ * cost no protection changes (no mprotect() and no TLB shootdown), at the price
+ * of twice as many mappings. Implies TPS_MODE_KERNEL_COW.
+ */
+#define TPS_MODE_DEFAULT	0
+#define TPS_MODE_KERNEL_COW	1
+#define TPS_MODE_DOUBLE_MAP	2
+
+/*
+ * tps_init_mode - Initialize TPS in a given mode
+ * @segv - Activate segfault handler
+ * @mode - TPS mode
+ *
+ * Same as tps_init(), but selects how TPS areas are backed and cloned.
+ * tps_init(@segv) is equivalent to tps_init_mode(@segv, TPS_MODE_DEFAULT).
+ *
+ * Return: -1 if TPS API has already been initialized, if @mode is not a
+ * combination of the modes above, or in case of failure during the
+ * initialization. 0 if the TPS API was successfully initialized.
+ */
+int tps_init_mode(int segv, int mode);
+
 /*
  * tps_create - Create TPS
  *
@@ -36,6 +76,34 @@ int tps_init(int segv);
  */
 int tps_create(void);
 
+/*
+ * tps_create_sized - Create TPS of a given size
+ * @size: Size of the TPS area in bytes
+ *
+ * Same as tps_create(), but the TPS area can hold @size bytes, rounded up to a
+ * multiple of TPS_SIZE. tps_create() is equivalent to
+ * tps_create_sized(TPS_SIZE).
+ *
+ * Return: -1 if @size is 0, if current thread already has a TPS, or in case of
+ * failure during the creation (e.g. memory allocation). 0 if the TPS area was
+ * successfully created.
+ */
+int tps_create_sized(size_t size);
+
+/*
+ * tps_resize - Resize TPS
+ * @size: New size of the TPS area in bytes
+ *
+ * Grow or shrink the current thread's TPS area so that it can hold @size bytes,
+ * rounded up to a multiple of TPS_SIZE. The contents of the area are preserved
+ * up to the smaller of the two sizes; whatever the area grows by is initialized
+ * to all zeros. Growing doesn't copy the existing contents.
+ *
+ * Return: -1 if @size is 0, if current thread doesn't have a TPS, or in case of
+ * failure. 0 if the TPS area was successfully resized.
+ */
+int tps_resize(size_t size);
+
 /*
  * tps_destroy - Destroy TPS
  *
@@ -72,6 +140,7 @@ int tps_read(size_t offset, size_t length, void *buffer);
  *
  * If the current thread's TPS shares a memory page with another thread's TPS,
  * this should trigger a copy-on-write operation before the actual write occurs.
+ * Only the pages written to are copied.
  *
  * Return: -1 if current thread doesn't have a TPS, or if the writing operation
  * is out of bound, or if @buffer is NULL, or in case of failure. 0 if the TPS
@@ -79,6 +148,86 @@ int tps_read(size_t offset, size_t length, void *buffer);
  */
 int tps_write(size_t offset, size_t length, void *buffer);
 
+/*
+ * tps_segment_t - Segment of a vectored TPS access
+ * @offset: Offset in the TPS
+ * @length: Length of the data
+ * @buffer: Data buffer to read into, or holding the data to write
+ */
+typedef struct tps_segment {
+	size_t offset;
+	size_t length;
+	void *buffer;
+} tps_segment_t;
+
+/*
+ * tps_readv - Read several segments from TPS
+ * @segments: Array of segments to read
+ * @count: Number of segments in @segments
+ *
+ * Same as calling tps_read() on each segment in order, but in one go: the TPS
+ * is looked up and unprotected only once for all the segments.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if any segment is out of
+ * bound or has a NULL buffer, in which case no data is read at all. 0 if the
+ * TPS was successfully read from.
+ */
+int tps_readv(const tps_segment_t *segments, size_t count);
+
+/*
+ * tps_writev - Write several segments to TPS
+ * @segments: Array of segments to write
+ * @count: Number of segments in @segments
+ *
+ * Same as calling tps_write() on each segment in order, but in one go: the TPS
+ * is looked up, copied-on-write where needed and unprotected only once for all
+ * the segments. Segments that overlap are written in order.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if any segment is out of
+ * bound or has a NULL buffer, in which case no data is written at all, or in
+ * case of failure. 0 if the TPS was successfully written to.
+ */
+int tps_writev(const tps_segment_t *segments, size_t count);
+
+/*
+ * TPS map modes
+ *
+ * TPS_MAP_READ: the mapped TPS can only be read from.
+ * TPS_MAP_WRITE: the mapped TPS can be read from and written to.
+ */
+#define TPS_MAP_READ	1
+#define TPS_MAP_WRITE	2
+
+/*
+ * tps_map - Access TPS in place
+ * @mode: TPS map mode
+ *
+ * Open a session during which the current thread accesses its TPS directly,
+ * without copying data in and out of it. The TPS is unprotected once for the
+ * whole session and protected again by tps_unmap(). With TPS_MAP_WRITE, any
+ * copy-on-write the TPS still owes its clones is done right away.
+ *
+ * While the session is open, the TPS cannot be read, written, resized,
+ * destroyed or cloned through the rest of the API. In TPS_MODE_DOUBLE_MAP, the
+ * returned address is the TPS API's own view of the TPS, which is never
+ * protected and therefore stays accessible after tps_unmap().
+ *
+ * Return: Address of the first byte of the TPS, valid until tps_unmap(). NULL
+ * if current thread doesn't have a TPS, or if it already has a session open,
+ * or if @mode is invalid, or in case of failure.
+ */
+void *tps_map(int mode);
+
+/*
+ * tps_unmap - End in-place access to TPS
+ *
+ * Close the session opened by tps_map(). The TPS is protected again.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or doesn't have a session
+ * open. 0 if the session was successfully closed.
+ */
+int tps_unmap(void);
+
 /*
  * tps_clone - Clone TPS
  * @tid: TID of the thread to clone
@@ -87,9 +236,27 @@ int tps_write(size_t offset, size_t length, void *buffer);
  * copied directly. In the last phase, the new TPS should not copy the cloned
  * TPS's content but should refer to the same memory page.
  *
- * Return: -1 if thread @tid doesn't have a TPS, or if current thread already
- * has a TPS, or in case of failure. 0 is TPS was successfully cloned.
+ * The new TPS has the same size as thread @tid's. When the TPS is made of
+ * several pages, each page is copied on its own first write.
+ *
+ * Return: -1 if thread @tid doesn't have a TPS, or has it mapped with tps_map(),
+ * or if current thread already has a TPS, or in case of failure. 0 is TPS was
+ * successfully cloned.
  */
 int tps_clone(pthread_t tid);
 
+/*
+ * tps_reserve - Prepare TPS areas ahead of time
+ * @count: Number of TPS areas to keep ready
+ *
+ * Map and prefault memory for @count TPS areas, so that the next @count TPS
+ * creations (or copy-on-writes) neither map memory nor take a page fault on
+ * first access. Areas freed later on are kept ready in the same way, up to
+ * @count of them.
+ *
+ * Return: -1 in case of failure (e.g. memory allocation). 0 if the TPS areas
+ * were successfully reserved.
+ */
+int tps_reserve(size_t count);
+
 #endif /* _TPS_H */
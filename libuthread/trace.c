@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+#ifdef UTHREAD_TRACE
+
+// Events per thread, a power of two
+#define RING_SIZE	4096
+// How often the background thread drains the rings
+#define FLUSH_INTERVAL_NS	10000000
+
+typedef struct event {
+	const char* name;
+	const char* arg;
+	uintptr_t value;
+	uint64_t ts;
+	char phase;
+} event;
+
+// Events of one thread. The thread appends at `head` and the background thread
+// takes them out at `tail`, each side only ever moving its own index, so
+// neither takes a lock. Once its thread has exited and it has been drained,
+// a ring goes to the next thread that needs one.
+typedef struct ring {
+	event events[RING_SIZE];
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_size_t dropped;
+	size_t reported;
+	atomic_int dead;
+	int free;
+	pid_t tid;
+	struct ring* next;
+} ring;
+
+// All rings ever handed out, and the trace file, belong to `ringsLock`
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static ring* rings;
+static FILE* out;
+static int firstEvent = 1;
+
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+static pthread_t flusher;
+static atomic_int stopping;
+static int tracing;
+
+static __thread ring* myRing;
+
+static void writeEvent(const char* name, char phase, pid_t tid, uint64_t ts, const char* arg, const char* value)
+{
+	fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ".%03" PRIu64 ",\"pid\":%d,\"tid\":%d",
+		firstEvent ? "" : ",\n", name, phase, ts / 1000, ts % 1000, (int) getpid(), (int) tid);
+	if (phase == 'i')
+		fputs(",\"s\":\"t\"", out);
+	if (arg != NULL)
+		fprintf(out, ",\"args\":{\"%s\":\"%s\"}", arg, value);
+	fputs("}", out);
+	firstEvent = 0;
+}
+
+// Write out the events of @r, under `ringsLock`
+static void drain(ring* r)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	for (; tail != head; tail++) {
+		event* e = &r->events[tail & (RING_SIZE - 1)];
+		char value[2 + 2 * sizeof(uintptr_t) + 1];
+		snprintf(value, sizeof(value), "0x%" PRIxPTR, e->value);
+		writeEvent(e->name, e->phase, r->tid, e->ts, e->arg, value);
+	}
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+	size_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+	if (dropped != r->reported) {
+		char count[24];
+		snprintf(count, sizeof(count), "%zu", dropped - r->reported);
+		writeEvent("trace_dropped", 'i', r->tid, nowNs(), "events", count);
+		r->reported = dropped;
+	}
+}
+
+static void drainAll(void)
+{
+	pthread_mutex_lock(&ringsLock);
+	if (out != NULL) {
+		for (ring* r = rings; r != NULL; r = r->next) {
+			// A ring is only done with if its thread was gone before
+			// we drained it
+			int dead = atomic_load(&r->dead);
+			drain(r);
+			if (dead)
+				r->free = 1;
+		}
+		fflush(out);
+	}
+	pthread_mutex_unlock(&ringsLock);
+}
+
+static void* flushLoop(__attribute__((unused)) void* arg)
+{
+	struct timespec interval = { 0, FLUSH_INTERVAL_NS };
+	while (!atomic_load(&stopping)) {
+		nanosleep(&interval, NULL);
+		drainAll();
+	}
+	return NULL;
+}
+
+// Drain whatever is left and complete the file
+static void stopTracing(void)
+{
+	atomic_store(&stopping, 1);
+	pthread_join(flusher, NULL);
+	drainAll();
+
+	pthread_mutex_lock(&ringsLock);
+	fputs("\n]\n", out);
+	fclose(out);
+	out = NULL;
+	pthread_mutex_unlock(&ringsLock);
+}
+
+static void ringExit(void* arg)
+{
+	ring* r = arg;
+	atomic_store(&r->dead, 1);
+}
+
+static void startTracing(void)
+{
+	const char* path = getenv("UTHREAD_TRACE_FILE");
+	out = fopen(path != NULL ? path : "uthread_trace.json", "w");
+	if (out == NULL) return;
+	if (pthread_key_create(&ringKey, ringExit) != 0 || pthread_create(&flusher, NULL, flushLoop, NULL) != 0) {
+		fclose(out);
+		out = NULL;
+		return;
+	}
+	fputs("[\n", out);
+	atexit(stopTracing);
+	tracing = 1;
+}
+
+// Give the thread a ring, preferably one left by a thread that is gone
+static ring* attachRing(void)
+{
+	pthread_once(&traceOnce, startTracing);
+	if (!tracing) return NULL;
+
+	pthread_mutex_lock(&ringsLock);
+	ring* r = rings;
+	while (r != NULL && !r->free)
+		r = r->next;
+	if (r == NULL) {
+		r = calloc(1, sizeof(ring));
+		if (r == NULL) {
+			pthread_mutex_unlock(&ringsLock);
+			return NULL;
+		}
+		r->next = rings;
+		rings = r;
+	}
+	r->free = 0;
+	atomic_store(&r->dead, 0);
+	r->tid = syscall(SYS_gettid);
+	pthread_mutex_unlock(&ringsLock);
+
+	pthread_setspecific(ringKey, r);
+	myRing = r;
+	return r;
+}
+
+void trace_event(const char *name, char phase, const char *arg, uintptr_t value)
+{
+	ring* r = myRing;
+	if (r == NULL && (r = attachRing()) == NULL) return;
+
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	event* e = &r->events[head & (RING_SIZE - 1)];
+	e->name = name;
+	e->arg = arg;
+	e->value = value;
+	e->ts = nowNs();
+	e->phase = phase;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+#endif /* UTHREAD_TRACE */
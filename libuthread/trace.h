@@ -0,0 +1,45 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Event tracing
+ *
+ * When the library is built with UTHREAD_TRACE defined (`make TRACE=1`), trace
+ * points record events in a ring buffer of the thread hitting them, without
+ * taking any lock. A background thread drains all rings every few
+ * milliseconds to a file in Chrome's trace event format, which Perfetto and
+ * chrome://tracing open as a timeline with one track per thread. The file is
+ * named by the UTHREAD_TRACE_FILE environment variable (uthread_trace.json by
+ * default) and is completed at exit. A thread whose ring is full drops its
+ * events rather than wait, and the trace says how many were dropped.
+ *
+ * Otherwise, trace points compile to nothing.
+ *
+ * TRACE_BEGIN: the thread starts an activity called @name (e.g. sleeping on a
+ * semaphore), with a single argument @arg (a string) of value @value.
+ * TRACE_END: the thread ends the activity it started last.
+ * TRACE_INSTANT: something called @name happens in the thread, with argument
+ * @arg of value @value.
+ *
+ * Names and arguments must be string literals, as only their address is
+ * recorded. Values are printed in hexadecimal.
+ */
+#ifdef UTHREAD_TRACE
+
+void trace_event(const char *name, char phase, const char *arg, uintptr_t value);
+
+#define TRACE_BEGIN(name, arg, value)	trace_event(name, 'B', arg, (uintptr_t) (value))
+#define TRACE_END(name)			trace_event(name, 'E', NULL, 0)
+#define TRACE_INSTANT(name, arg, value)	trace_event(name, 'i', arg, (uintptr_t) (value))
+
+#else
+
+#define TRACE_BEGIN(name, arg, value)	((void) 0)
+#define TRACE_END(name)			((void) 0)
+#define TRACE_INSTANT(name, arg, value)	((void) 0)
+
+#endif /* UTHREAD_TRACE */
+
+#endif /* _TRACE_H */
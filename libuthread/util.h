@@ -0,0 +1,33 @@
+#ifndef _UTIL_H
+#define _UTIL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Helpers shared by the library's modules
+ *
+ * hashTid: spread every bit of the (opaque) thread ID @tid over the returned
+ * value, so that masking it gives a good bucket index in a table of thread IDs.
+ *
+ * nowNs: the time of CLOCK_MONOTONIC, in nanoseconds.
+ */
+static inline size_t hashTid(pthread_t tid)
+{
+	uint64_t h = (uint64_t)(uintptr_t) tid;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t) h;
+}
+
+static inline uint64_t nowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif /* _UTIL_H */
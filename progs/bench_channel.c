@@ -0,0 +1,381 @@
+/*
+ * Channel throughput benchmark
+ *
+ * Time the workloads of sem_buffer and sem_prime, without their output, both
+ * as they are built out of semaphores and as they are ported to channels:
+ *
+ * - buffer: a producer hands numbers (1000000 by default) to a consumer
+ *   through a 16-slot buffer, one at a time, then in random batches of up to
+ *   8 on either side;
+ * - prime: the sieve pipeline, with one filter thread per prime found below
+ *   a maximum (3000 by default).
+ *
+ * Results are in nanoseconds per number handed over, for the buffer, and per
+ * number generated, for the sieve.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <channel.h>
+#include <sem.h>
+
+#define BUFFER_SIZE	16
+#define MAXBATCH	(BUFFER_SIZE / 2)
+#define NITEMS		1000000
+#define MAXPRIME	3000
+
+#define clamp(x, y) (((x) <= (y)) ? (x) : (y))
+
+static size_t nitems = NITEMS;
+static unsigned int max = MAXPRIME;
+
+static struct timespec start;
+
+static void timer_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+static void timer_report(const char *name, size_t n)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+	printf("%-20s %10zu %10.2f\n", name, n, ns / n);
+}
+
+/* Batch size for the next round: 1, or random up to MAXBATCH */
+static size_t next_batch(unsigned int *seed, size_t batch, size_t left)
+{
+	if (batch > 1)
+		batch = rand_r(seed) % batch + 1;
+	return clamp(batch, left);
+}
+
+/*
+ * Buffer, with semaphores
+ */
+struct sem_buffer {
+	sem_t empty, full, mutex;
+	size_t size, head, tail, batch;
+	size_t buffer[BUFFER_SIZE];
+};
+
+static void *sem_producer(void *arg)
+{
+	struct sem_buffer *b = arg;
+	unsigned int seed = 2;
+	size_t count = 0;
+
+	while (count < nitems) {
+		size_t n = next_batch(&seed, b->batch, nitems - count);
+		sem_down_n(b->full, n);
+		for (size_t i = 0; i < n; i++) {
+			b->buffer[b->head] = count++;
+			b->head = (b->head + 1) % BUFFER_SIZE;
+		}
+		sem_down(b->mutex);
+		b->size += n;
+		sem_up(b->mutex);
+		sem_up_n(b->empty, n);
+	}
+	return NULL;
+}
+
+static void *sem_consumer(void *arg)
+{
+	struct sem_buffer *b = arg;
+	unsigned int seed = 1;
+	size_t count = 0;
+
+	while (count < nitems) {
+		size_t n = next_batch(&seed, b->batch, nitems - count);
+		sem_down_n(b->empty, n);
+		for (size_t i = 0; i < n; i++) {
+			assert(b->buffer[b->tail] == count++);
+			b->tail = (b->tail + 1) % BUFFER_SIZE;
+		}
+		sem_down(b->mutex);
+		b->size -= n;
+		sem_up(b->mutex);
+		sem_up_n(b->full, n);
+	}
+	return NULL;
+}
+
+static void bench_sem_buffer(const char *name, size_t batch)
+{
+	struct sem_buffer b = { .size = 0, .head = 0, .tail = 0, .batch = batch };
+	pthread_t tid[2];
+
+	b.mutex = sem_create(1);
+	b.empty = sem_create(0);
+	b.full = sem_create(BUFFER_SIZE);
+
+	timer_start();
+	pthread_create(&tid[0], NULL, sem_producer, &b);
+	pthread_create(&tid[1], NULL, sem_consumer, &b);
+	pthread_join(tid[0], NULL);
+	pthread_join(tid[1], NULL);
+	timer_report(name, nitems);
+
+	sem_destroy(b.empty);
+	sem_destroy(b.full);
+	sem_destroy(b.mutex);
+}
+
+/*
+ * Buffer, with a channel
+ */
+struct chan_buffer {
+	channel_t channel;
+	size_t batch;
+};
+
+static void *chan_producer(void *arg)
+{
+	struct chan_buffer *b = arg;
+	void *items[MAXBATCH];
+	unsigned int seed = 2;
+	size_t count = 0;
+
+	while (count < nitems) {
+		size_t n = next_batch(&seed, b->batch, nitems - count);
+		if (n == 1) {
+			channel_send(b->channel, (void*)(uintptr_t) count++);
+			continue;
+		}
+		for (size_t i = 0; i < n; i++)
+			items[i] = (void*)(uintptr_t) count++;
+		channel_send_many(b->channel, items, n);
+	}
+	return NULL;
+}
+
+static void *chan_consumer(void *arg)
+{
+	struct chan_buffer *b = arg;
+	void *items[MAXBATCH];
+	unsigned int seed = 1;
+	size_t count = 0;
+
+	while (count < nitems) {
+		size_t n = next_batch(&seed, b->batch, nitems - count);
+		if (n == 1) {
+			channel_recv(b->channel, items);
+		} else {
+			n = channel_recv_many(b->channel, items, n);
+		}
+		for (size_t i = 0; i < n; i++)
+			assert((uintptr_t) items[i] == count++);
+	}
+	return NULL;
+}
+
+static void bench_chan_buffer(const char *name, size_t batch)
+{
+	struct chan_buffer b = { .channel = channel_create(BUFFER_SIZE), .batch = batch };
+	pthread_t tid[2];
+
+	timer_start();
+	pthread_create(&tid[0], NULL, chan_producer, &b);
+	pthread_create(&tid[1], NULL, chan_consumer, &b);
+	pthread_join(tid[0], NULL);
+	pthread_join(tid[1], NULL);
+	timer_report(name, nitems);
+
+	channel_destroy(b.channel);
+}
+
+/*
+ * Sieve, with semaphores: one value handed over per pair of semaphores
+ */
+struct sem_link {
+	int value;
+	sem_t produce, consume;
+};
+
+struct sem_filter {
+	struct sem_link *left, *right;
+	int prime;
+	pthread_t tid;
+};
+
+static void sem_link_send(struct sem_link *l, int value)
+{
+	l->value = value;
+	sem_up(l->consume);
+	sem_down(l->produce);
+}
+
+static int sem_link_recv(struct sem_link *l)
+{
+	sem_down(l->consume);
+	int value = l->value;
+	sem_up(l->produce);
+	return value;
+}
+
+static struct sem_link *sem_link_create(void)
+{
+	struct sem_link *l = malloc(sizeof(*l));
+	l->produce = sem_create(0);
+	l->consume = sem_create(0);
+	return l;
+}
+
+static void sem_link_destroy(struct sem_link *l)
+{
+	sem_destroy(l->produce);
+	sem_destroy(l->consume);
+	free(l);
+}
+
+static void *sem_source(void *arg)
+{
+	for (unsigned int i = 2; i <= max; i++)
+		sem_link_send(arg, i);
+	sem_link_send(arg, -1);
+	return NULL;
+}
+
+static void *sem_filter(void *arg)
+{
+	struct sem_filter *f = arg;
+	int value;
+
+	do {
+		value = sem_link_recv(f->left);
+		if (value == -1 || value % f->prime != 0)
+			sem_link_send(f->right, value);
+	} while (value != -1);
+	return NULL;
+}
+
+static void bench_sem_prime(void)
+{
+	struct sem_filter *filters = malloc(max * sizeof(*filters));
+	struct sem_link *first = sem_link_create(), *p = first;
+	size_t nfilters = 0;
+	pthread_t tid;
+	int value;
+
+	timer_start();
+	pthread_create(&tid, NULL, sem_source, p);
+	while ((value = sem_link_recv(p)) != -1) {
+		struct sem_filter *f = &filters[nfilters++];
+		f->left = p;
+		f->prime = value;
+		f->right = p = sem_link_create();
+		pthread_create(&f->tid, NULL, sem_filter, f);
+	}
+	pthread_join(tid, NULL);
+	for (size_t i = 0; i < nfilters; i++)
+		pthread_join(filters[i].tid, NULL);
+	timer_report("prime/sem", max - 1);
+
+	sem_link_destroy(first);
+	for (size_t i = 0; i < nfilters; i++)
+		sem_link_destroy(filters[i].right);
+	free(filters);
+}
+
+/*
+ * Sieve, with channels
+ */
+struct chan_filter {
+	channel_t left, right;
+	int prime;
+	pthread_t tid;
+};
+
+static int chan_recv_value(channel_t c)
+{
+	void *item;
+	channel_recv(c, &item);
+	return (intptr_t) item;
+}
+
+static void *chan_source(void *arg)
+{
+	for (unsigned int i = 2; i <= max; i++)
+		channel_send(arg, (void*)(intptr_t) i);
+	channel_send(arg, (void*)(intptr_t) -1);
+	return NULL;
+}
+
+static void *chan_filter(void *arg)
+{
+	struct chan_filter *f = arg;
+	int value;
+
+	do {
+		value = chan_recv_value(f->left);
+		if (value == -1 || value % f->prime != 0)
+			channel_send(f->right, (void*)(intptr_t) value);
+	} while (value != -1);
+	return NULL;
+}
+
+static void bench_chan_prime(void)
+{
+	struct chan_filter *filters = malloc(max * sizeof(*filters));
+	channel_t first = channel_create(BUFFER_SIZE), p = first;
+	size_t nfilters = 0;
+	pthread_t tid;
+	int value;
+
+	timer_start();
+	pthread_create(&tid, NULL, chan_source, p);
+	while ((value = chan_recv_value(p)) != -1) {
+		struct chan_filter *f = &filters[nfilters++];
+		f->left = p;
+		f->prime = value;
+		f->right = p = channel_create(BUFFER_SIZE);
+		pthread_create(&f->tid, NULL, chan_filter, f);
+	}
+	pthread_join(tid, NULL);
+	for (size_t i = 0; i < nfilters; i++)
+		pthread_join(filters[i].tid, NULL);
+	timer_report("prime/channel", max - 1);
+
+	channel_destroy(first);
+	for (size_t i = 0; i < nfilters; i++)
+		channel_destroy(filters[i].right);
+	free(filters);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		nitems = get_argv(argv[1]);
+	if (argc > 2)
+		max = get_argv(argv[2]);
+	assert(nitems > 0 && max >= 2);
+
+	printf("%-20s %10s %10s\n", "# workload", "numbers", "ns/number");
+	bench_sem_buffer("buffer/sem", 1);
+	bench_chan_buffer("buffer/channel", 1);
+	bench_sem_buffer("buffer-batch/sem", MAXBATCH);
+	bench_chan_buffer("buffer-batch/channel", MAXBATCH);
+	bench_sem_prime();
+	bench_chan_prime();
+
+	return 0;
+}
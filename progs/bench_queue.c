@@ -0,0 +1,160 @@
+/*
+ * Queue microbenchmark
+ *
+ * Time the queue operations in a few patterns: steady enqueue/dequeue pairs at
+ * several queue depths, filling and draining a long queue, deleting from the
+ * middle, and iterating. Results are in nanoseconds per operation.
+ *
+ * This program is linked twice: bench_queue.x against the library's ring
+ * buffer queue, and bench_queue_list.x against the original linked-list queue
+ * (queue_list.o), so that both can be compared on the same machine. The
+ * optional argument scales the number of operations (1000000 by default).
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <queue.h>
+
+#define NOPS	1000000
+
+#define ITEM(i)	((void*)(uintptr_t)((i) + 1))
+
+static struct timespec start;
+
+static void timer_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+static void timer_report(const char *name, size_t depth, size_t nops)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+	printf("%-10s %8zu %10.2f\n", name, depth, ns / nops);
+}
+
+static void fill(queue_t queue, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		queue_enqueue(queue, ITEM(i));
+}
+
+static void drain(queue_t queue)
+{
+	void *data;
+	while (queue_dequeue(queue, &data) == 0)
+		;
+}
+
+static int count(__attribute__((unused)) void *data, void *arg)
+{
+	(*(size_t*) arg)++;
+	return 0;
+}
+
+/* One enqueue and one dequeue per operation, the queue staying @depth long */
+static void bench_steady(size_t depth, size_t nops)
+{
+	queue_t queue = queue_create();
+	void *data;
+
+	fill(queue, depth - 1);
+	timer_start();
+	for (size_t i = 0; i < nops; i++) {
+		queue_enqueue(queue, ITEM(i));
+		queue_dequeue(queue, &data);
+	}
+	timer_report("steady", depth, nops);
+	drain(queue);
+	queue_destroy(queue);
+}
+
+/* Fill a queue up to @depth, then drain it: one operation per item */
+static void bench_burst(size_t depth, size_t nops)
+{
+	queue_t queue = queue_create();
+	size_t rounds = nops / depth + 1;
+
+	timer_start();
+	for (size_t r = 0; r < rounds; r++) {
+		fill(queue, depth);
+		drain(queue);
+	}
+	timer_report("burst", depth, rounds * depth);
+	queue_destroy(queue);
+}
+
+/* Delete the item in the middle of a @depth long queue, and put it back */
+static void bench_delete(size_t depth, size_t nops)
+{
+	queue_t queue = queue_create();
+
+	fill(queue, depth);
+	nops = nops / depth + 1;
+	timer_start();
+	for (size_t i = 0; i < nops; i++) {
+		void *item = ITEM((depth / 2 + i) % depth);
+		queue_delete(queue, item);
+		queue_enqueue(queue, item);
+	}
+	timer_report("delete", depth, nops);
+	drain(queue);
+	queue_destroy(queue);
+}
+
+/* Visit every item of a @depth long queue: one operation per item */
+static void bench_iterate(size_t depth, size_t nops)
+{
+	queue_t queue = queue_create();
+	size_t rounds = nops / depth + 1;
+	size_t visited = 0;
+
+	fill(queue, depth);
+	timer_start();
+	for (size_t r = 0; r < rounds; r++)
+		queue_iterate(queue, count, &visited, NULL);
+	timer_report("iterate", depth, visited);
+	drain(queue);
+	queue_destroy(queue);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t depths[] = { 1, 8, 64, 4096 };
+	size_t nops = NOPS;
+
+	if (argc > 1)
+		nops = get_argv(argv[1]);
+	assert(nops > 0);
+
+	const char *name = strrchr(argv[0], '/');
+	printf("# %s: ns/op\n", name != NULL ? name + 1 : argv[0]);
+	printf("%-10s %8s %10s\n", "# pattern", "depth", "ns/op");
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+		bench_steady(depths[i], nops);
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+		bench_burst(depths[i], nops);
+	for (size_t i = 1; i < sizeof(depths) / sizeof(depths[0]); i++)
+		bench_delete(depths[i], nops);
+	for (size_t i = 1; i < sizeof(depths) / sizeof(depths[0]); i++)
+		bench_iterate(depths[i], nops);
+
+	return 0;
+}
@@ -0,0 +1,467 @@
+/*
+ * Semaphore microbenchmark
+ *
+ * Time the semaphores in the patterns the other programs use them in:
+ *
+ * - uncontended: each thread takes and releases a semaphore of its own;
+ * - pingpong: pairs of threads hand a turn back and forth through two
+ *   semaphores, as in sem_count (one operation is a round trip);
+ * - prodcons: producers and consumers share a 16-slot buffer guarded by three
+ *   semaphores, as in sem_buffer, in even and uneven mixes (reported as P+C
+ *   threads for P producers and C consumers);
+ * - pipeline: numbers go through a chain of forwarding threads, each link
+ *   being a value and two semaphores, as in sem_prime.
+ *
+ * Each pattern is run for several thread counts (or pipeline depths), and
+ * reported in nanoseconds per operation along with the 50th, 99th and 99.9th
+ * percentiles of the latency of single operations: a down and up pair, a round
+ * trip, or the time from an item's production to its consumption. Latencies
+ * include the cost of reading the clock, so the uncontended pattern is timed
+ * once without reading it for its ns/op, and once more for its latencies.
+ *
+ * The first optional argument scales the number of operations (100000 by
+ * default). If a second one is given, results are also written to that file
+ * as JSON, so that they can be compared from one commit to the next.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sem.h>
+
+#define NOPS		100000
+#define BUFFER_SIZE	16
+#define MAXTHREADS	8
+
+struct result {
+	const char *name;
+	size_t threads;
+	/* Producer/consumer split of the threads, 0 for other patterns */
+	size_t producers, consumers;
+	size_t ops;
+	double ns_per_op;
+	uint64_t p50, p99, p999;
+};
+
+static size_t nops = NOPS;
+static struct result results[64];
+static size_t nresults;
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+	return sorted[(size_t) ((n - 1) * p)];
+}
+
+/* Record a result, from the elapsed time and the latencies of @n operations */
+static struct result *record(const char *name, size_t threads, size_t n, uint64_t elapsed, uint64_t *samples)
+{
+	struct result *r = &results[nresults++];
+
+	assert(nresults <= sizeof(results) / sizeof(results[0]));
+	qsort(samples, n, sizeof(uint64_t), compare);
+	r->name = name;
+	r->threads = threads;
+	r->ops = n;
+	r->ns_per_op = (double) elapsed / n;
+	r->p50 = percentile(samples, n, 0.5);
+	r->p99 = percentile(samples, n, 0.99);
+	r->p999 = percentile(samples, n, 0.999);
+	r->producers = r->consumers = 0;
+	return r;
+}
+
+static void print(const struct result *r)
+{
+	char threads[24];
+
+	if (r->producers > 0)
+		snprintf(threads, sizeof(threads), "%zu+%zu", r->producers, r->consumers);
+	else
+		snprintf(threads, sizeof(threads), "%zu", r->threads);
+	printf("%-12s %8s %10zu %10.2f %8llu %8llu %8llu\n", r->name, threads, r->ops, r->ns_per_op,
+	       (unsigned long long) r->p50, (unsigned long long) r->p99, (unsigned long long) r->p999);
+}
+
+static void report(const char *name, size_t threads, size_t n, uint64_t elapsed, uint64_t *samples)
+{
+	print(record(name, threads, n, elapsed, samples));
+}
+
+static void write_json(const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL) {
+		perror("fopen");
+		exit(1);
+	}
+	fprintf(f, "{\n  \"benchmark\": \"bench_sem\",\n  \"results\": [\n");
+	for (size_t i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+		fprintf(f, "    {\"name\": \"%s\", \"threads\": %zu, ", r->name, r->threads);
+		if (r->producers > 0)
+			fprintf(f, "\"producers\": %zu, \"consumers\": %zu, ", r->producers, r->consumers);
+		fprintf(f, "\"ops\": %zu, \"ns_per_op\": %.2f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}%s\n",
+			r->ops, r->ns_per_op, (unsigned long long) r->p50, (unsigned long long) r->p99,
+			(unsigned long long) r->p999, i + 1 < nresults ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+}
+
+/* Run @func in @n threads, each getting its own element of @args */
+static uint64_t run_threads(void *(*func)(void *), void *args, size_t size, size_t n)
+{
+	pthread_t tids[2 * MAXTHREADS];
+	uint64_t start = now_ns();
+
+	for (size_t i = 0; i < n; i++)
+		pthread_create(&tids[i], NULL, func, (char*) args + i * size);
+	for (size_t i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	return now_ns() - start;
+}
+
+/*
+ * Uncontended
+ */
+struct uncontended {
+	sem_t sem;
+	uint64_t *samples;
+};
+
+static void *uncontended_fast(void *arg)
+{
+	struct uncontended *u = arg;
+
+	for (size_t i = 0; i < nops; i++) {
+		sem_down(u->sem);
+		sem_up(u->sem);
+	}
+	return NULL;
+}
+
+static void *uncontended_timed(void *arg)
+{
+	struct uncontended *u = arg;
+
+	for (size_t i = 0; i < nops; i++) {
+		uint64_t start = now_ns();
+		sem_down(u->sem);
+		sem_up(u->sem);
+		u->samples[i] = now_ns() - start;
+	}
+	return NULL;
+}
+
+static void bench_uncontended(size_t nthreads)
+{
+	struct uncontended u[MAXTHREADS];
+	uint64_t *samples = malloc(nthreads * nops * sizeof(uint64_t));
+
+	for (size_t i = 0; i < nthreads; i++) {
+		u[i].sem = sem_create(1);
+		u[i].samples = samples + i * nops;
+	}
+	uint64_t elapsed = run_threads(uncontended_fast, u, sizeof(u[0]), nthreads);
+	run_threads(uncontended_timed, u, sizeof(u[0]), nthreads);
+	/* Threads run side by side: the time per operation is per thread */
+	report("uncontended", nthreads, nthreads * nops, elapsed * nthreads, samples);
+
+	for (size_t i = 0; i < nthreads; i++)
+		sem_destroy(u[i].sem);
+	free(samples);
+}
+
+/*
+ * Ping-pong
+ */
+struct pingpong {
+	sem_t ping, pong;
+	uint64_t *samples;
+};
+
+static void *pinger(void *arg)
+{
+	struct pingpong *p = arg;
+
+	for (size_t i = 0; i < nops; i++) {
+		uint64_t start = now_ns();
+		sem_up(p->ping);
+		sem_down(p->pong);
+		p->samples[i] = now_ns() - start;
+	}
+	return NULL;
+}
+
+static void *ponger(void *arg)
+{
+	struct pingpong *p = arg;
+
+	for (size_t i = 0; i < nops; i++) {
+		sem_down(p->ping);
+		sem_up(p->pong);
+	}
+	return NULL;
+}
+
+static void *pingpong_pair(void *arg)
+{
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, ponger, arg);
+	pinger(arg);
+	pthread_join(tid, NULL);
+	return NULL;
+}
+
+static void bench_pingpong(size_t npairs)
+{
+	struct pingpong p[MAXTHREADS];
+	uint64_t *samples = malloc(npairs * nops * sizeof(uint64_t));
+
+	for (size_t i = 0; i < npairs; i++) {
+		p[i].ping = sem_create(0);
+		p[i].pong = sem_create(0);
+		p[i].samples = samples + i * nops;
+	}
+	uint64_t elapsed = run_threads(pingpong_pair, p, sizeof(p[0]), npairs);
+	report("pingpong", 2 * npairs, npairs * nops, elapsed * npairs, samples);
+
+	for (size_t i = 0; i < npairs; i++) {
+		sem_destroy(p[i].ping);
+		sem_destroy(p[i].pong);
+	}
+	free(samples);
+}
+
+/*
+ * Producers and consumers: items are their production time, and consumers
+ * record how long they took to get through. Each side splits the items evenly
+ * among its threads.
+ */
+struct prodcons {
+	sem_t empty, full, mutex;
+	size_t head, tail;
+	uint64_t buffer[BUFFER_SIZE];
+	uint64_t *samples;
+	atomic_size_t nsamples;
+};
+
+struct prodcons_thread {
+	struct prodcons *b;
+	size_t n;
+};
+
+static void *producer(void *arg)
+{
+	struct prodcons_thread *t = arg;
+	struct prodcons *b = t->b;
+
+	for (size_t i = 0; i < t->n; i++) {
+		sem_down(b->full);
+		sem_down(b->mutex);
+		b->buffer[b->head] = now_ns();
+		b->head = (b->head + 1) % BUFFER_SIZE;
+		sem_up(b->mutex);
+		sem_up(b->empty);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct prodcons_thread *t = arg;
+	struct prodcons *b = t->b;
+
+	for (size_t i = 0; i < t->n; i++) {
+		sem_down(b->empty);
+		sem_down(b->mutex);
+		uint64_t produced = b->buffer[b->tail];
+		b->tail = (b->tail + 1) % BUFFER_SIZE;
+		sem_up(b->mutex);
+		sem_up(b->full);
+		b->samples[atomic_fetch_add(&b->nsamples, 1)] = now_ns() - produced;
+	}
+	return NULL;
+}
+
+/* Give thread @i of @n its share of @total items */
+static size_t share(size_t total, size_t n, size_t i)
+{
+	return total / n + (i < total % n);
+}
+
+static void bench_prodcons(size_t nproducers, size_t nconsumers)
+{
+	struct prodcons b = { .head = 0, .tail = 0 };
+	struct prodcons_thread t[2 * MAXTHREADS];
+	pthread_t tids[2 * MAXTHREADS];
+	size_t nthreads = nproducers + nconsumers;
+
+	assert(nproducers <= MAXTHREADS && nconsumers <= MAXTHREADS);
+	b.mutex = sem_create(1);
+	b.empty = sem_create(0);
+	b.full = sem_create(BUFFER_SIZE);
+	b.samples = malloc(nops * sizeof(uint64_t));
+	atomic_init(&b.nsamples, 0);
+	for (size_t i = 0; i < nproducers; i++)
+		t[i] = (struct prodcons_thread) { &b, share(nops, nproducers, i) };
+	for (size_t i = 0; i < nconsumers; i++)
+		t[nproducers + i] = (struct prodcons_thread) { &b, share(nops, nconsumers, i) };
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, i < nproducers ? producer : consumer, &t[i]);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	struct result *r = record("prodcons", nthreads, nops, now_ns() - start, b.samples);
+	r->producers = nproducers;
+	r->consumers = nconsumers;
+	print(r);
+
+	sem_destroy(b.empty);
+	sem_destroy(b.full);
+	sem_destroy(b.mutex);
+	free(b.samples);
+}
+
+/*
+ * Pipeline: one value handed over per pair of semaphores, from the source
+ * through @depth forwarding stages to the sink
+ */
+struct link {
+	uint64_t value;
+	sem_t produce, consume;
+};
+
+struct stage {
+	struct link *left, *right;
+};
+
+static void link_send(struct link *l, uint64_t value)
+{
+	l->value = value;
+	sem_up(l->consume);
+	sem_down(l->produce);
+}
+
+static uint64_t link_recv(struct link *l)
+{
+	sem_down(l->consume);
+	uint64_t value = l->value;
+	sem_up(l->produce);
+	return value;
+}
+
+static void *source(void *arg)
+{
+	for (size_t i = 0; i < nops; i++)
+		link_send(arg, now_ns());
+	return NULL;
+}
+
+static void *forward(void *arg)
+{
+	struct stage *s = arg;
+
+	for (size_t i = 0; i < nops; i++)
+		link_send(s->right, link_recv(s->left));
+	return NULL;
+}
+
+static void bench_pipeline(size_t depth)
+{
+	struct link *links = malloc((depth + 1) * sizeof(struct link));
+	struct stage *stages = malloc(depth * sizeof(struct stage));
+	pthread_t *tids = malloc(depth * sizeof(pthread_t));
+	uint64_t *samples = malloc(nops * sizeof(uint64_t));
+	pthread_t tid;
+
+	for (size_t i = 0; i <= depth; i++) {
+		links[i].produce = sem_create(0);
+		links[i].consume = sem_create(0);
+	}
+
+	uint64_t start = now_ns();
+	pthread_create(&tid, NULL, source, &links[0]);
+	for (size_t i = 0; i < depth; i++) {
+		stages[i].left = &links[i];
+		stages[i].right = &links[i + 1];
+		pthread_create(&tids[i], NULL, forward, &stages[i]);
+	}
+	for (size_t i = 0; i < nops; i++) {
+		uint64_t sent = link_recv(&links[depth]);
+		samples[i] = now_ns() - sent;
+	}
+	pthread_join(tid, NULL);
+	for (size_t i = 0; i < depth; i++)
+		pthread_join(tids[i], NULL);
+	report("pipeline", depth, nops, now_ns() - start, samples);
+
+	for (size_t i = 0; i <= depth; i++) {
+		sem_destroy(links[i].produce);
+		sem_destroy(links[i].consume);
+	}
+	free(samples);
+	free(tids);
+	free(stages);
+	free(links);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t threads[] = { 1, 2, 4, 8 };
+	static const size_t depths[] = { 1, 2, 4, 8, 16, 32 };
+	/* Producers and consumers */
+	static const size_t mixes[][2] = { { 1, 1 }, { 1, 4 }, { 4, 1 }, { 4, 4 }, { 8, 8 } };
+	const size_t nthreads = sizeof(threads) / sizeof(threads[0]);
+
+	if (argc > 1)
+		nops = get_argv(argv[1]);
+	assert(nops >= MAXTHREADS);
+
+	printf("%-12s %8s %10s %10s %8s %8s %8s\n", "# pattern", "threads", "ops", "ns/op", "p50", "p99", "p999");
+	for (size_t i = 0; i < nthreads; i++)
+		bench_uncontended(threads[i]);
+	for (size_t i = 0; i < nthreads; i++)
+		bench_pingpong(threads[i]);
+	for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+		bench_prodcons(mixes[i][0], mixes[i][1]);
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+		bench_pipeline(depths[i]);
+
+	if (argc > 2)
+		write_json(argv[2]);
+
+	return 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * TPS microbenchmark
+ *
+ * Time the TPS operations while more and more TPS areas are alive (1 to 10000
+ * by default, each held by a thread of its own that sleeps meanwhile):
+ *
+ * - create: tps_create() and tps_destroy() pairs;
+ * - read/write: tps_read() and tps_write() of 8, 512 and 4096 bytes;
+ * - clone: tps_clone() of the main thread's TPS;
+ * - cow: the first write of 8 bytes to a fresh clone, which has to copy the
+ *   page it shares with its source.
+ *
+ * Then have several threads (1 to 8) read and write 512 bytes of their own TPS
+ * at the same time (rw: a read then a write).
+ *
+ * Results are in nanoseconds per operation, along with the memory mapping
+ * calls (mmap, munmap, mremap, madvise) and mprotect calls made per operation,
+ * which are counted by wrapping them at link time (see the Makefile): an
+ * operation whose cost grows with the number of TPS areas, or that starts
+ * making more system calls, shows up here.
+ *
+ * The optional arguments are the number of operations (10000 by default), the
+ * TPS mode (see tps.h, 0 by default) and the largest number of live TPS areas.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <sem.h>
+#include <tps.h>
+
+#define NOPS		10000
+#define MAXLIVE		10000
+#define MAXTHREADS	8
+#define HOLDER_STACK	(64 * 1024)
+
+static size_t nops = NOPS;
+
+/*
+ * System call counters
+ */
+static atomic_size_t nmap, nprot;
+
+void *__real_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off);
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
+{
+	atomic_fetch_add(&nmap, 1);
+	return __real_mmap(addr, len, prot, flags, fildes, off);
+}
+
+int __real_munmap(void *addr, size_t len);
+int __wrap_munmap(void *addr, size_t len)
+{
+	atomic_fetch_add(&nmap, 1);
+	return __real_munmap(addr, len);
+}
+
+void *__real_mremap(void *old, size_t oldsize, size_t newsize, int flags, ...);
+void *__wrap_mremap(void *old, size_t oldsize, size_t newsize, int flags, ...)
+{
+	void *fixed = NULL;
+
+	if (flags & MREMAP_FIXED) {
+		va_list ap;
+		va_start(ap, flags);
+		fixed = va_arg(ap, void*);
+		va_end(ap);
+	}
+	atomic_fetch_add(&nmap, 1);
+	return __real_mremap(old, oldsize, newsize, flags, fixed);
+}
+
+int __real_madvise(void *addr, size_t len, int advice);
+int __wrap_madvise(void *addr, size_t len, int advice)
+{
+	atomic_fetch_add(&nmap, 1);
+	return __real_madvise(addr, len, advice);
+}
+
+int __real_mprotect(void *addr, size_t len, int prot);
+int __wrap_mprotect(void *addr, size_t len, int prot)
+{
+	atomic_fetch_add(&nprot, 1);
+	return __real_mprotect(addr, len, prot);
+}
+
+/*
+ * Measurements: time and system calls spent in the operations being timed
+ */
+struct measure {
+	uint64_t ns;
+	size_t map, prot;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void measure_start(struct measure *m)
+{
+	m->map -= atomic_load(&nmap);
+	m->prot -= atomic_load(&nprot);
+	m->ns -= now_ns();
+}
+
+static void measure_stop(struct measure *m)
+{
+	m->ns += now_ns();
+	m->map += atomic_load(&nmap);
+	m->prot += atomic_load(&nprot);
+}
+
+static void report(const char *op, size_t live, size_t threads, size_t length, struct measure *m, size_t n)
+{
+	printf("%-8s %6zu %7zu %6zu %10.1f %8.2f %8.2f\n", op, live, threads, length,
+	       (double) m->ns / n, (double) m->map / n, (double) m->prot / n);
+}
+
+/*
+ * Holders: threads that keep a TPS alive until released. A holder that can't
+ * create its TPS (e.g. out of file descriptors in kernel copy-on-write mode)
+ * says so in `holder_failed` before signaling `holders_ready`, and leaves.
+ */
+static sem_t holders_ready, holders_release;
+static pthread_t *holders;
+static size_t nholders;
+static int holder_failed;
+
+static void *holder(__attribute__((unused)) void *arg)
+{
+	if (tps_create() < 0) {
+		holder_failed = 1;
+		sem_up(holders_ready);
+		return NULL;
+	}
+	sem_up(holders_ready);
+	sem_down(holders_release);
+	tps_destroy();
+	return NULL;
+}
+
+/* Bring the number of holders up to @n. Return how many there are. */
+static size_t add_holders(size_t n)
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, HOLDER_STACK);
+	while (nholders < n) {
+		if (pthread_create(&holders[nholders], &attr, holder, NULL) != 0)
+			break;
+		sem_down(holders_ready);
+		if (holder_failed) {
+			pthread_join(holders[nholders], NULL);
+			break;
+		}
+		nholders++;
+	}
+	pthread_attr_destroy(&attr);
+	return nholders;
+}
+
+static void release_holders(void)
+{
+	sem_up_n(holders_release, nholders);
+	for (size_t i = 0; i < nholders; i++)
+		pthread_join(holders[i], NULL);
+	nholders = 0;
+}
+
+/*
+ * Single-thread operations, with @live TPS areas alive
+ */
+static void bench_create(size_t live)
+{
+	struct measure m = { 0, 0, 0 };
+
+	measure_start(&m);
+	for (size_t i = 0; i < nops; i++) {
+		tps_create();
+		tps_destroy();
+	}
+	measure_stop(&m);
+	report("create", live, 1, TPS_SIZE, &m, nops);
+}
+
+static void bench_access(size_t live, size_t length)
+{
+	static char buffer[TPS_SIZE];
+	struct measure r = { 0, 0, 0 }, w = { 0, 0, 0 };
+
+	measure_start(&r);
+	for (size_t i = 0; i < nops; i++)
+		tps_read(0, length, buffer);
+	measure_stop(&r);
+	report("read", live, 1, length, &r, nops);
+
+	measure_start(&w);
+	for (size_t i = 0; i < nops; i++)
+		tps_write(0, length, buffer);
+	measure_stop(&w);
+	report("write", live, 1, length, &w, nops);
+}
+
+/* Clone a TPS over and over, and write to every clone once */
+struct cloner {
+	pthread_t source;
+	size_t n;
+	struct measure clone, cow;
+};
+
+static void *cloner(void *arg)
+{
+	struct cloner *c = arg;
+	char data[8] = "cow";
+
+	for (size_t i = 0; i < c->n; i++) {
+		measure_start(&c->clone);
+		assert(tps_clone(c->source) == 0);
+		measure_stop(&c->clone);
+
+		measure_start(&c->cow);
+		tps_write(0, sizeof(data), data);
+		measure_stop(&c->cow);
+
+		tps_destroy();
+	}
+	return NULL;
+}
+
+static void bench_clone(size_t live)
+{
+	struct cloner c = { .source = pthread_self(), .n = nops / 10 + 1 };
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, cloner, &c);
+	pthread_join(tid, NULL);
+	report("clone", live, 1, TPS_SIZE, &c.clone, c.n);
+	report("cow", live, 1, 8, &c.cow, c.n);
+}
+
+/*
+ * Several threads reading then writing 512 bytes of their own TPS at once
+ */
+static sem_t accessors_ready, accessors_go;
+
+static void *accessor(void *arg)
+{
+	static char buffer[MAXTHREADS][512];
+	char *b = buffer[(size_t) arg];
+
+	tps_create();
+	sem_up(accessors_ready);
+	sem_down(accessors_go);
+	for (size_t i = 0; i < nops; i++) {
+		tps_read(0, sizeof(buffer[0]), b);
+		tps_write(0, sizeof(buffer[0]), b);
+	}
+	tps_destroy();
+	return NULL;
+}
+
+static void bench_concurrent(size_t nthreads)
+{
+	pthread_t tids[MAXTHREADS];
+	struct measure m = { 0, 0, 0 };
+
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, accessor, (void*) i);
+	sem_down_n(accessors_ready, nthreads);
+
+	/* Threads run side by side: the time per operation is per thread */
+	measure_start(&m);
+	sem_up_n(accessors_go, nthreads);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	measure_stop(&m);
+	m.ns *= nthreads;
+	report("rw", nthreads, nthreads, 512, &m, nthreads * nops);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t lengths[] = { 8, 512, TPS_SIZE };
+	size_t maxlive = MAXLIVE;
+	int mode = TPS_MODE_DEFAULT;
+
+	if (argc > 1)
+		nops = get_argv(argv[1]);
+	if (argc > 2)
+		mode = get_argv(argv[2]);
+	if (argc > 3)
+		maxlive = get_argv(argv[3]);
+	assert(nops > 0 && maxlive > 0);
+
+	if (tps_init_mode(1, mode) < 0) {
+		fprintf(stderr, "Invalid TPS mode %d\n", mode);
+		return 1;
+	}
+	holders_ready = sem_create(0);
+	holders_release = sem_create(0);
+	holders = malloc(maxlive * sizeof(pthread_t));
+	accessors_ready = sem_create(0);
+	accessors_go = sem_create(0);
+
+	printf("# mode %d: ns/op, memory mapping and mprotect calls per op\n", mode);
+	printf("%-8s %6s %7s %6s %10s %8s %8s\n", "# op", "live", "threads", "length", "ns/op", "map/op", "prot/op");
+	for (size_t live = 1; live <= maxlive; live *= 10) {
+		/* The main thread's TPS is one of them */
+		if (add_holders(live - 1) < live - 1 || tps_create() < 0) {
+			fprintf(stderr, "Could only keep %zu TPS areas alive\n", nholders);
+			break;
+		}
+		tps_destroy();
+
+		bench_create(live);
+		assert(tps_create() == 0);
+		for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+			bench_access(live, lengths[i]);
+		bench_clone(live);
+		tps_destroy();
+	}
+	release_holders();
+
+	for (size_t n = 1; n <= MAXTHREADS; n *= 2)
+		bench_concurrent(n);
+
+	free(holders);
+	sem_destroy(holders_ready);
+	sem_destroy(holders_release);
+	sem_destroy(accessors_ready);
+	sem_destroy(accessors_go);
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Producer/consumer test over a channel
+ *
+ * Same as sem_buffer, with the shared buffer and its semaphores replaced by a
+ * channel: the producer sends batches of x values with channel_send_many(), and
+ * the consumer receives up to y of them at once with channel_recv_many(). Each
+ * batch costs one synchronization, and as the producer's batches are split
+ * whenever the channel fills up, x and y need not be bounded.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <channel.h>
+
+#define BUFFER_SIZE	16
+#define MAXCOUNT	1000
+
+struct test4 {
+	channel_t channel;
+	size_t maxcount;
+	unsigned int prod_seed, cons_seed;
+};
+
+#define clamp(x, y) (((x) <= (y)) ? (x) : (y))
+
+static void *consumer(void* arg)
+{
+	struct test4 *t = (struct test4*)arg;
+	void *items[BUFFER_SIZE];
+	size_t out = 0, expected = 0;
+
+	while (out < t->maxcount - 1) {
+		size_t i, n = rand_r(&t->cons_seed) % BUFFER_SIZE + 1;
+
+		n = clamp(n, t->maxcount - out - 1);
+		printf("Consumer wants to get %zu items out of buffer...\n", n);
+		n = channel_recv_many(t->channel, items, n);
+		for (i = 0; i < n; i++) {
+			out = (uintptr_t) items[i];
+			printf("Consumer is taking %zu out of buffer\n", out);
+			assert(out == expected++);
+		}
+	}
+
+	return NULL;
+}
+
+static void *producer(void* arg)
+{
+	struct test4 *t = (struct test4*)arg;
+	void *items[BUFFER_SIZE];
+	size_t count = 0;
+
+	while (count < t->maxcount) {
+		size_t i, n = rand_r(&t->prod_seed) % BUFFER_SIZE + 1;
+		n = clamp(n, t->maxcount - count);
+
+		printf("Producer wants to put %zu items into buffer...\n", n);
+		for (i = 0; i < n; i++) {
+			printf("Producer is putting %zu into buffer\n", count);
+			items[i] = (void*)(uintptr_t) count++;
+		}
+		channel_send_many(t->channel, items, n);
+	}
+
+	return NULL;
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct test4 t;
+	unsigned int maxcount = MAXCOUNT;
+	pthread_t tid[2];
+
+	t.cons_seed = 1;
+	t.prod_seed = 2;
+
+	if (argc > 1)
+		maxcount = get_argv(argv[1]);
+	if (argc > 2)
+		t.cons_seed = get_argv(argv[2]);
+	if (argc > 3)
+		t.prod_seed = get_argv(argv[3]);
+
+	t.maxcount = maxcount;
+	t.channel = channel_create(BUFFER_SIZE);
+
+	pthread_create(&tid[0], NULL, producer, &t);
+	pthread_create(&tid[1], NULL, consumer, &t);
+
+	pthread_join(tid[0], NULL);
+	pthread_join(tid[1], NULL);
+
+	assert(channel_destroy(t.channel) == 0);
+
+	return 0;
+}
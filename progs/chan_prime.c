@@ -0,0 +1,149 @@
+/*
+ * Sieve test for finding prime numbers, over channels
+ *
+ * Same as sem_prime, with each stage of the pipeline connected to the next by
+ * a channel instead of a value and two semaphores: a stage can run ahead of
+ * the next by up to CHANNEL_SIZE numbers rather than waiting for each number
+ * to be picked up.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <channel.h>
+
+#define MAXPRIME	1000
+#define CHANNEL_SIZE	16
+
+struct filter {
+	channel_t left;
+	channel_t right;
+	unsigned int prime;
+	pthread_t tid;
+	struct filter *next;
+};
+
+static unsigned int max = MAXPRIME;
+
+static void send_value(channel_t c, int value)
+{
+	channel_send(c, (void*)(intptr_t) value);
+}
+
+static int recv_value(channel_t c)
+{
+	void *item;
+
+	channel_recv(c, &item);
+	return (intptr_t) item;
+}
+
+/* Producer thread: produces all numbers, from 2 to max */
+static void *source(void *arg)
+{
+	channel_t c = arg;
+	size_t i;
+
+	for (i = 2; i <= max; i++)
+		send_value(c, i);
+
+	/* mark completion */
+	send_value(c, -1);
+
+	return NULL;
+}
+
+/* Filter thread */
+static void *filter(void *arg)
+{
+	struct filter *f = (struct filter*) arg;
+	int value;
+
+	while (1) {
+		value = recv_value(f->left);
+		if ((value == -1) || (value % f->prime != 0))
+			send_value(f->right, value);
+		if (value == -1)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Consumer thread */
+static void *sink(__attribute__((unused)) void *arg)
+{
+	channel_t init_p, p;
+	int value;
+	pthread_t tid;
+	struct filter *f_head = NULL;
+
+	init_p = p = channel_create(CHANNEL_SIZE);
+
+	pthread_create(&tid, NULL, source, p);
+
+	while (1) {
+		struct filter *f;
+
+		value = recv_value(p);
+		if (value == -1)
+			break;
+
+		printf("%d is prime.\n", value);
+
+		f = malloc(sizeof(*f));
+		f->left = p;
+		f->prime = value;
+		f->next = NULL;
+
+		p = channel_create(CHANNEL_SIZE);
+		f->right = p;
+
+		pthread_create(&f->tid, NULL, filter, f);
+
+		if (f_head)
+			f->next = f_head;
+		f_head = f;
+	}
+
+	pthread_join(tid, NULL);
+	channel_destroy(init_p);
+
+	while (f_head) {
+		struct filter *old = f_head;
+
+		pthread_join(f_head->tid, NULL);
+		channel_destroy(f_head->right);
+		f_head = f_head->next;
+		free(old);
+	}
+
+	return NULL;
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid;
+
+	if (argc > 1)
+		max = get_argv(argv[1]);
+
+	pthread_create(&tid, NULL, sink, NULL);
+	pthread_join(tid, NULL);
+
+	return 0;
+}
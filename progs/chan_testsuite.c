@@ -0,0 +1,230 @@
+/*
+ * Channel test
+ *
+ * Check that the non-blocking calls fail on a full or an empty channel, and
+ * that closing a channel lets its items drain but fails every send, and every
+ * receive once it is empty, including those blocked at the time. Then have
+ * several producers and consumers (4 of each by default) move a number of
+ * items (100000 by default) through a small channel, and check that every item
+ * was received exactly once by adding them all up.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <channel.h>
+#include <sem.h>
+
+#define CAPACITY	4
+#define NTHREADS	4
+#define NITEMS		100000
+#define BATCH		8
+
+#define ITEM(i)	((void*)(uintptr_t)(i))
+
+static channel_t channel;
+static sem_t started;
+
+static void test_try(void)
+{
+	void *item;
+
+	channel = channel_create(CAPACITY);
+	assert(channel_tryrecv(channel, &item) == -1);
+	for (size_t i = 0; i < CAPACITY; i++)
+		assert(channel_trysend(channel, ITEM(i)) == 0);
+	assert(channel_trysend(channel, ITEM(CAPACITY)) == -1);
+	for (size_t i = 0; i < CAPACITY; i++) {
+		assert(channel_tryrecv(channel, &item) == 0);
+		assert(item == ITEM(i));
+	}
+	assert(channel_tryrecv(channel, &item) == -1);
+	assert(channel_destroy(channel) == 0);
+}
+
+static void *blocked_recv(__attribute__((unused)) void *arg)
+{
+	void *item;
+
+	sem_up(started);
+	return (void*)(intptr_t) channel_recv(channel, &item);
+}
+
+static void *blocked_send(__attribute__((unused)) void *arg)
+{
+	sem_up(started);
+	return (void*)(intptr_t) channel_send(channel, ITEM(0));
+}
+
+/* Start @n threads blocking in @fn, close the channel, and check they fail */
+static void close_blocked(void *(*fn)(void*), size_t n)
+{
+	pthread_t tids[NTHREADS];
+	void *ret;
+
+	for (size_t i = 0; i < n; i++)
+		pthread_create(&tids[i], NULL, fn, NULL);
+	sem_down_n(started, n);
+	/* Give them time to block */
+	for (int i = 0; i < 1000; i++)
+		sched_yield();
+	assert(channel_close(channel) == 0);
+	for (size_t i = 0; i < n; i++) {
+		pthread_join(tids[i], &ret);
+		assert((intptr_t) ret == -1);
+	}
+}
+
+static void test_close(void)
+{
+	void *items[CAPACITY];
+	void *item;
+
+	/* Items sent before closing can still be received */
+	channel = channel_create(CAPACITY);
+	assert(channel_close(NULL) == -1);
+	assert(channel_send(channel, ITEM(1)) == 0);
+	assert(channel_send(channel, ITEM(2)) == 0);
+	assert(channel_close(channel) == 0);
+	assert(channel_close(channel) == -1);
+	assert(channel_send(channel, ITEM(3)) == -1);
+	assert(channel_trysend(channel, ITEM(3)) == -1);
+	assert(channel_send_many(channel, items, 1) == -1);
+	assert(channel_recv(channel, &item) == 0 && item == ITEM(1));
+	assert(channel_tryrecv(channel, &item) == 0 && item == ITEM(2));
+	assert(channel_tryrecv(channel, &item) == -1);
+	assert(channel_recv(channel, &item) == -1);
+	assert(channel_recv_many(channel, items, CAPACITY) == -1);
+	assert(channel_destroy(channel) == 0);
+
+	/* Receivers blocked on an empty channel */
+	channel = channel_create(CAPACITY);
+	close_blocked(blocked_recv, NTHREADS);
+	assert(channel_destroy(channel) == 0);
+
+	/* Senders blocked on a full channel */
+	channel = channel_create(CAPACITY);
+	for (size_t i = 0; i < CAPACITY; i++)
+		assert(channel_send(channel, ITEM(i)) == 0);
+	close_blocked(blocked_send, NTHREADS);
+	assert(channel_recv_many(channel, items, CAPACITY) == CAPACITY);
+	assert(channel_destroy(channel) == 0);
+}
+
+/*
+ * Multiple producers and consumers
+ */
+struct mpmc {
+	size_t first, count;
+	uint64_t sum;
+	size_t received;
+};
+
+static void *producer(void *arg)
+{
+	struct mpmc *p = arg;
+	void *items[BATCH];
+	size_t i = p->first, end = p->first + p->count;
+
+	while (i < end) {
+		size_t n = 0;
+		while (n < BATCH && i < end)
+			items[n++] = ITEM(i++);
+		assert(channel_send_many(channel, items, n) == 0);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct mpmc *c = arg;
+	void *items[BATCH];
+	long n;
+
+	/* Alternate single and batch receives until the channel is closed */
+	while (1) {
+		if (c->received % 2)
+			n = channel_recv_many(channel, items, BATCH);
+		else
+			n = channel_recv(channel, items) == 0 ? 1 : -1;
+		if (n < 0)
+			break;
+		for (long i = 0; i < n; i++)
+			c->sum += (uintptr_t) items[i];
+		c->received += n;
+	}
+	return NULL;
+}
+
+static void test_mpmc(size_t nthreads, size_t nitems)
+{
+	pthread_t *prods = malloc(nthreads * sizeof(pthread_t));
+	pthread_t *conss = malloc(nthreads * sizeof(pthread_t));
+	struct mpmc *p = calloc(nthreads, sizeof(struct mpmc));
+	struct mpmc *c = calloc(nthreads, sizeof(struct mpmc));
+	size_t received = 0;
+	uint64_t sum = 0;
+
+	channel = channel_create(CAPACITY);
+	for (size_t i = 0; i < nthreads; i++) {
+		p[i].first = nitems / nthreads * i;
+		p[i].count = i == nthreads - 1 ? nitems - p[i].first : nitems / nthreads;
+		pthread_create(&prods[i], NULL, producer, &p[i]);
+		pthread_create(&conss[i], NULL, consumer, &c[i]);
+	}
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(prods[i], NULL);
+	assert(channel_close(channel) == 0);
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(conss[i], NULL);
+		received += c[i].received;
+		sum += c[i].sum;
+	}
+
+	/* Every item from 0 to nitems - 1 exactly once */
+	assert(received == nitems);
+	assert(sum == (uint64_t) nitems * (nitems - 1) / 2);
+	assert(channel_destroy(channel) == 0);
+
+	free(prods);
+	free(conss);
+	free(p);
+	free(c);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nthreads = NTHREADS;
+	size_t nitems = NITEMS;
+
+	if (argc > 1)
+		nthreads = get_argv(argv[1]);
+	if (argc > 2)
+		nitems = get_argv(argv[2]);
+	assert(nthreads > 0);
+
+	started = sem_create(0);
+	test_try();
+	test_close();
+	test_mpmc(nthreads, nitems);
+	sem_destroy(started);
+
+	printf("chan_testsuite: all tests passed\n");
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Critical section profiler test
+ *
+ * Several threads (4 by default) enter the critical section a number of times
+ * (10000 by default) from two call sites, one of which holds it for a little
+ * while. Check that every entry was accounted to its call site, that entries
+ * from before the profiler was on weren't, and that the histograms account for
+ * every entry. Then print the profile, once directly and once on a signal.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <thread.h>
+
+#define NTHREADS	4
+#define NITERS		10000
+#define HOLD_NS		20000
+
+static struct cs_site quick = CS_SITE_INIT;
+static struct cs_site slow = CS_SITE_INIT;
+static size_t niters = NITERS;
+static size_t counter;
+
+static void hold_for(long ns)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000000 + (now.tv_nsec - start.tv_nsec) < ns);
+}
+
+static void *worker(__attribute__((unused)) void *arg)
+{
+	for (size_t i = 0; i < niters; i++) {
+		enter_critical_section_at(&quick);
+		counter++;
+		/* Nested entries are accounted to the outermost one */
+		enter_critical_section();
+		exit_critical_section();
+		exit_critical_section();
+	}
+
+	enter_critical_section_at(&slow);
+	hold_for(HOLD_NS);
+	exit_critical_section();
+
+	return NULL;
+}
+
+static void check_hist(const uint64_t *hist, uint64_t count)
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < CS_PROFILE_BUCKETS; i++)
+		total += hist[i];
+	assert(total == count);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nthreads = NTHREADS;
+
+	if (argc > 1)
+		nthreads = get_argv(argv[1]);
+	if (argc > 2)
+		niters = get_argv(argv[2]);
+
+	/* Not profiled yet */
+	enter_critical_section_at(&quick);
+	exit_critical_section();
+	assert(quick.acquires == 0);
+
+	cs_profile_enable(1);
+	assert(cs_profile_dump_on_signal(SIGUSR1) == 0);
+
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, worker, NULL);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	cs_profile_enable(0);
+
+	assert(counter == nthreads * niters);
+	assert(quick.acquires == nthreads * niters);
+	check_hist(quick.wait_hist, quick.acquires);
+	check_hist(quick.hold_hist, quick.acquires);
+	assert(slow.acquires == nthreads);
+	assert(slow.hold_max >= HOLD_NS);
+	assert(slow.hold_total >= nthreads * HOLD_NS);
+	check_hist(slow.hold_hist, nthreads);
+
+	cs_profile_dump(STDOUT_FILENO);
+	raise(SIGUSR1);
+
+	free(tids);
+	printf("cs_profile: all tests passed\n");
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Concurrent queue test
+ *
+ * Several producers and consumers (4 of each) share a queue made by
+ * queue_create_concurrent(), without any other synchronization. Each producer
+ * enqueues its own numbered items (100000 by default), which every consumer
+ * must see in increasing order for any given producer, and all items must come
+ * out exactly once.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <queue.h>
+
+#define NPRODUCERS	4
+#define NCONSUMERS	4
+#define NITEMS		100000
+
+static queue_t queue;
+static size_t nitems;
+static atomic_size_t consumed;
+static atomic_char *seen;
+
+/* Items are numbered from 1, as the queue can't hold NULL */
+static void *producer(void *arg)
+{
+	uintptr_t id = (uintptr_t) arg;
+
+	for (uintptr_t i = 0; i < nitems; i++)
+		assert(queue_enqueue(queue, (void*)(id * nitems + i + 1)) == 0);
+
+	return NULL;
+}
+
+static void *consumer(__attribute__((unused)) void *arg)
+{
+	size_t last[NPRODUCERS] = { 0 };
+	void *data;
+
+	while (atomic_load(&consumed) < NPRODUCERS * nitems) {
+		if (queue_dequeue(queue, &data) < 0) {
+			sched_yield();
+			continue;
+		}
+		size_t item = (uintptr_t) data - 1;
+		size_t id = item / nitems;
+		size_t i = item % nitems + 1;
+
+		/* FIFO for each producer */
+		assert(id < NPRODUCERS && i > last[id]);
+		last[id] = i;
+		assert(atomic_exchange(&seen[item], 1) == 0);
+		atomic_fetch_add(&consumed, 1);
+	}
+
+	return NULL;
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t producers[NPRODUCERS], consumers[NCONSUMERS];
+	void *data;
+
+	nitems = NITEMS;
+	if (argc > 1)
+		nitems = get_argv(argv[1]);
+
+	queue = queue_create_concurrent();
+	assert(queue != NULL);
+	assert(queue_dequeue(queue, &data) == -1);
+	seen = calloc(NPRODUCERS * nitems, sizeof(atomic_char));
+
+	for (uintptr_t i = 0; i < NCONSUMERS; i++)
+		pthread_create(&consumers[i], NULL, consumer, NULL);
+	for (uintptr_t i = 0; i < NPRODUCERS; i++)
+		pthread_create(&producers[i], NULL, producer, (void*) i);
+	for (size_t i = 0; i < NPRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	for (size_t i = 0; i < NCONSUMERS; i++)
+		pthread_join(consumers[i], NULL);
+
+	assert(atomic_load(&consumed) == NPRODUCERS * nitems);
+	assert(queue_length(queue) == 0);
+	assert(queue_dequeue(queue, &data) == -1);
+
+	/* Only enqueue and dequeue make sense on a shared queue */
+	queue_enqueue(queue, &data);
+	assert(queue_delete(queue, &data) == -1);
+	assert(queue_destroy(queue) == -1);
+	assert(queue_dequeue(queue, &data) == 0);
+	assert(queue_destroy(queue) == 0);
+
+	free(seen);
+	printf("queue_concurrent: all tests passed\n");
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Queue test
+ *
+ * Check the queue's FIFO order across growth and wraparound (with 1000 items
+ * by default), deletion from either end and from the middle, and iteration,
+ * including deleting other items and enqueueing new ones from the callback.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <queue.h>
+
+#define NITEMS	1000
+
+#define ITEM(i)	((void*)(uintptr_t)((i) + 1))
+
+static int find(void *data, void *arg)
+{
+	return data == arg;
+}
+
+struct visit {
+	queue_t queue;
+	size_t visited;
+};
+
+/* Delete the item preceding each visited one, which was visited already */
+static int delete_prev(void *data, void *arg)
+{
+	struct visit *visit = arg;
+
+	visit->visited++;
+	queue_delete(visit->queue, (char*) data - 1);
+	return 0;
+}
+
+static int count(__attribute__((unused)) void *data, void *arg)
+{
+	(*(size_t*) arg)++;
+	return 0;
+}
+
+/* Enqueue one more item the first time round */
+static int append(void *data, void *arg)
+{
+	if (data == ITEM(0))
+		queue_enqueue(arg, ITEM(1));
+	return 0;
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nitems = NITEMS;
+	void *data;
+	size_t n, next;
+
+	if (argc > 1)
+		nitems = get_argv(argv[1]);
+	/* Enough items for every test to have some left */
+	if (nitems < 8)
+		nitems = 8;
+
+	queue_t queue = queue_create();
+	assert(queue_enqueue(queue, NULL) == -1);
+	assert(queue_dequeue(queue, &data) == -1);
+	assert(queue_destroy(NULL) == -1);
+
+	/* FIFO order, with the head moving around the buffer as it grows */
+	for (size_t round = 0; round < 3; round++) {
+		next = 0;
+		for (size_t i = 0; i < nitems; i++) {
+			assert(queue_enqueue(queue, ITEM(i)) == 0);
+			if (i % 3 == 0) {
+				assert(queue_dequeue(queue, &data) == 0);
+				assert(data == ITEM(next));
+				next++;
+				/* Delete from the tail */
+				assert(queue_enqueue(queue, data) == 0);
+				assert(queue_delete(queue, data) == 0);
+			}
+		}
+		while (queue_dequeue(queue, &data) == 0) {
+			assert(data == ITEM(next));
+			next++;
+		}
+		assert(next == nitems);
+	}
+	assert(queue_length(queue) == 0);
+
+	for (size_t i = 0; i < nitems; i++)
+		queue_enqueue(queue, ITEM(i));
+
+	/* Delete from both ends and from the middle */
+	assert(queue_delete(queue, ITEM(nitems)) == -1);
+	assert(queue_delete(queue, ITEM(0)) == 0);
+	assert(queue_delete(queue, ITEM(nitems - 1)) == 0);
+	assert(queue_delete(queue, ITEM(nitems / 2)) == 0);
+	assert(queue_delete(queue, ITEM(nitems / 2)) == -1);
+	assert(queue_length(queue) == (int) nitems - 3);
+
+	/* Iterate up to an item */
+	data = NULL;
+	assert(queue_iterate(queue, find, ITEM(nitems / 4), &data) == 0);
+	assert(data == ITEM(nitems / 4));
+
+	/* Deleting items behind the current one doesn't skip any */
+	struct visit visit = { queue, 0 };
+	n = queue_length(queue);
+	assert(queue_iterate(queue, delete_prev, &visit, NULL) == 0);
+	assert(visit.visited == n);
+	n = 0;
+	queue_iterate(queue, count, &n, NULL);
+	assert(n == 2);
+	while (queue_dequeue(queue, &data) == 0)
+		;
+
+	/* Items enqueued while iterating are visited too */
+	queue_enqueue(queue, ITEM(0));
+	n = 0;
+	assert(queue_iterate(queue, append, queue, NULL) == 0);
+	queue_iterate(queue, count, &n, NULL);
+	assert(n == 2);
+	assert(queue_dequeue(queue, &data) == 0 && data == ITEM(0));
+	assert(queue_dequeue(queue, &data) == 0 && data == ITEM(1));
+
+	assert(queue_destroy(queue) == 0);
+	printf("queue_testsuite: all tests passed\n");
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Wait-on-any semaphore test
+ *
+ * Check the error cases of sem_down_any() and that it takes the first
+ * semaphore available. Then fan in: one producer per semaphore (10 by default,
+ * every other one with the SEM_HANDOFF policy) releases its semaphore a number
+ * of times (10000 by default), while two dispatchers take them all with
+ * sem_down_any(). Every resource must be taken exactly once, from the
+ * semaphore it was released to, and no thread may be left in any queue.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sem.h>
+
+#define NSEMS		10
+#define NITEMS		10000
+#define NDISPATCHERS	2
+
+static sem_t *sems;
+static size_t nsems = NSEMS;
+static size_t nitems = NITEMS;
+static atomic_size_t *received;
+static atomic_size_t dispatched;
+
+static void *producer(void *arg)
+{
+	sem_t sem = arg;
+
+	for (size_t i = 0; i < nitems; i++) {
+		sem_up(sem);
+		if (i % 64 == 0)
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void *dispatcher(__attribute__((unused)) void *arg)
+{
+	size_t index;
+
+	while (atomic_fetch_add(&dispatched, 1) < nsems * nitems) {
+		assert(sem_down_any(sems, nsems, &index) == 0);
+		assert(index < nsems);
+		atomic_fetch_add(&received[index], 1);
+	}
+
+	return NULL;
+}
+
+static void test_simple(void)
+{
+	sem_t s[3];
+	size_t index;
+
+	s[0] = sem_create(0);
+	s[1] = sem_create(0);
+	s[2] = sem_create(0);
+
+	assert(sem_down_any(NULL, 3, &index) == -1);
+	assert(sem_down_any(s, 0, &index) == -1);
+	assert(sem_down_any(s, 3, NULL) == -1);
+
+	sem_up(s[2]);
+	sem_up(s[1]);
+	assert(sem_down_any(s, 3, &index) == 0 && index == 1);
+	assert(sem_down_any(s, 3, &index) == 0 && index == 2);
+
+	for (size_t i = 0; i < 3; i++)
+		sem_destroy(s[i]);
+	s[1] = NULL;
+	assert(sem_down_any(s, 3, &index) == -1);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t dispatchers[NDISPATCHERS];
+
+	if (argc > 1)
+		nsems = get_argv(argv[1]);
+	if (argc > 2)
+		nitems = get_argv(argv[2]);
+	assert(nsems > 0);
+
+	test_simple();
+
+	sems = malloc(nsems * sizeof(sem_t));
+	received = calloc(nsems, sizeof(atomic_size_t));
+	pthread_t *producers = malloc(nsems * sizeof(pthread_t));
+	for (size_t i = 0; i < nsems; i++)
+		sems[i] = sem_create_policy(0, i % 2 ? SEM_HANDOFF : SEM_BARGING);
+
+	for (size_t i = 0; i < NDISPATCHERS; i++)
+		pthread_create(&dispatchers[i], NULL, dispatcher, NULL);
+	for (size_t i = 0; i < nsems; i++)
+		pthread_create(&producers[i], NULL, producer, sems[i]);
+
+	for (size_t i = 0; i < nsems; i++)
+		pthread_join(producers[i], NULL);
+	for (size_t i = 0; i < NDISPATCHERS; i++)
+		pthread_join(dispatchers[i], NULL);
+
+	for (size_t i = 0; i < nsems; i++) {
+		int sval;
+
+		assert(atomic_load(&received[i]) == nitems);
+		sem_getvalue(sems[i], &sval);
+		assert(sval == 0);
+		assert(sem_destroy(sems[i]) == 0);
+	}
+
+	printf("%zu resources taken from %zu semaphores\n", nsems * nitems, nsems);
+
+	free(producers);
+	free(received);
+	free(sems);
+
+	return 0;
+}
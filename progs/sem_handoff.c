@@ -0,0 +1,97 @@
+/*
+ * Semaphore handoff test
+ *
+ * Queue up threads (10 by default) on a semaphore with the SEM_HANDOFF policy,
+ * one after the other. Each resource released must then go straight to the
+ * oldest waiter, out of reach of any other thread trying to take it, so that
+ * the threads get their resource in the order they queued up.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sem.h>
+
+#define NTHREADS	10
+
+static sem_t sem, done;
+static size_t *order;
+static size_t served;
+
+static void *waiter(void *arg)
+{
+	size_t id = (size_t) arg;
+
+	sem_down(sem);
+	order[served++] = id;
+	sem_up(done);
+
+	return NULL;
+}
+
+static void wait_for_waiters(int n)
+{
+	int sval;
+
+	do {
+		sched_yield();
+		sem_getvalue(sem, &sval);
+	} while (sval != -n);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nthreads = NTHREADS;
+
+	if (argc > 1)
+		nthreads = get_argv(argv[1]);
+
+	assert(sem_create_policy(0, -1) == NULL);
+	sem = sem_create_policy(0, SEM_HANDOFF);
+	done = sem_create(0);
+	order = malloc(nthreads * sizeof(size_t));
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_create(&tids[i], NULL, waiter, (void*) i);
+		wait_for_waiters(i + 1);
+	}
+
+	for (size_t i = 0; i < nthreads; i++) {
+		sem_up(sem);
+		/* The resource already belongs to the oldest waiter */
+		assert(sem_trydown(sem) == -1);
+		sem_down(done);
+	}
+
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		assert(order[i] == i);
+	}
+
+	/* Without waiters, resources are taken as usual */
+	sem_up(sem);
+	assert(sem_trydown(sem) == 0);
+
+	sem_destroy(sem);
+	sem_destroy(done);
+	free(order);
+	free(tids);
+	printf("sem_handoff: all tests passed\n");
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Semaphore statistics test
+ *
+ * Check that nothing is counted while statistics are disabled. Then have two
+ * threads hand a number back and forth (1000 times by default) through two
+ * semaphores, as in sem_count, and check that every down and up was counted
+ * and that the wait time histogram accounts for every down that blocked.
+ * Finally print the statistics of all semaphores.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sem.h>
+
+#define MAXCOUNT	1000
+
+static sem_t sem1, sem2;
+static size_t maxcount = MAXCOUNT;
+
+static void *thread2(__attribute__((unused)) void *arg)
+{
+	for (size_t i = 0; i < maxcount; i++) {
+		sem_up(sem1);
+		sem_down(sem2);
+	}
+
+	return NULL;
+}
+
+static void *thread1(__attribute__((unused)) void *arg)
+{
+	for (size_t i = 0; i < maxcount; i++) {
+		sem_down(sem1);
+		sem_up(sem2);
+	}
+
+	return NULL;
+}
+
+static void check_stats(sem_t sem, uint64_t count)
+{
+	struct sem_stats stats;
+	uint64_t hist = 0;
+
+	assert(sem_getstats(sem, &stats) == 0);
+	assert(stats.downs == count);
+	assert(stats.ups == count);
+	assert(stats.blocked <= count);
+	assert(stats.wait_max_ns <= stats.wait_total_ns);
+	for (int i = 0; i < SEM_STATS_BUCKETS; i++)
+		hist += stats.wait_hist[i];
+	assert(hist == stats.blocked);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid[2];
+
+	if (argc > 1)
+		maxcount = get_argv(argv[1]);
+
+	sem1 = sem_create(0);
+	sem2 = sem_create(0);
+
+	assert(sem_getstats(NULL, NULL) == -1);
+	assert(sem_getstats(sem1, NULL) == -1);
+
+	/* Disabled: nothing counted */
+	sem_up(sem1);
+	sem_down(sem1);
+	check_stats(sem1, 0);
+
+	sem_stats_enable(1);
+	sem_up(sem1);
+	assert(sem_trydown(sem1) == 0);
+	assert(sem_trydown(sem1) == -1);
+	check_stats(sem1, 1);
+
+	pthread_create(&tid[0], NULL, thread1, NULL);
+	pthread_create(&tid[1], NULL, thread2, NULL);
+	pthread_join(tid[0], NULL);
+	pthread_join(tid[1], NULL);
+
+	check_stats(sem1, maxcount + 1);
+	check_stats(sem2, maxcount);
+
+	sem_stats_enable(0);
+	sem_up(sem2);
+	sem_down(sem2);
+	check_stats(sem2, maxcount);
+
+	sem_stats_dump(stdout);
+
+	sem_destroy(sem1);
+	sem_destroy(sem2);
+
+	return 0;
+}
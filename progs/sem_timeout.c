@@ -0,0 +1,110 @@
+/*
+ * Non-blocking and timed semaphore test
+ *
+ * Check that sem_trydown() never blocks, that sem_down_timeout() gives up once
+ * its deadline has passed but not before, and that it still takes a resource
+ * released in time. Then have many threads (100 by default) time out on the
+ * same semaphore at once, and check that none of them is left in its queue.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sem.h>
+
+#define NTHREADS	100
+
+static sem_t sem;
+
+static void deadline_in(struct timespec *deadline, long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+static long ms_since(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void *late_up(__attribute__((unused)) void *arg)
+{
+	struct timespec delay = { 0, 20000000 };
+	nanosleep(&delay, NULL);
+	sem_up(sem);
+	return NULL;
+}
+
+static void *timed_waiter(__attribute__((unused)) void *arg)
+{
+	struct timespec deadline;
+	deadline_in(&deadline, 50);
+	assert(sem_down_timeout(sem, &deadline) == -1);
+	return NULL;
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, deadline;
+	size_t nthreads = NTHREADS;
+	pthread_t tid;
+	int sval;
+
+	if (argc > 1)
+		nthreads = get_argv(argv[1]);
+
+	sem = sem_create(0);
+
+	/* Try down */
+	assert(sem_trydown(sem) == -1);
+	sem_up(sem);
+	assert(sem_trydown(sem) == 0);
+	assert(sem_trydown(sem) == -1);
+
+	/* Time out */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline_in(&deadline, 30);
+	assert(sem_down_timeout(sem, &deadline) == -1);
+	assert(ms_since(&start) >= 30);
+
+	/* Resource released before the deadline */
+	pthread_create(&tid, NULL, late_up, NULL);
+	deadline_in(&deadline, 5000);
+	assert(sem_down_timeout(sem, &deadline) == 0);
+	pthread_join(tid, NULL);
+
+	/* Many waiters timing out together */
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, timed_waiter, NULL);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	assert(sem_getvalue(sem, &sval) == 0 && sval == 0);
+	assert(sem_destroy(sem) == 0);
+	printf("sem_timeout: all tests passed\n");
+
+	return 0;
+}
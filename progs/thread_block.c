@@ -0,0 +1,103 @@
+/*
+ * Thread blocking test
+ *
+ * Several threads (10 by default) block themselves from within the critical
+ * section, and the main thread unblocks them all, in reverse order, from
+ * within a single critical section. Each thread must be back in the critical
+ * section when it returns from thread_block(), and unblocking a thread that
+ * isn't blocked must fail. Then the same threads block and get unblocked
+ * again, this time outside of the critical section.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <thread.h>
+
+#define NTHREADS	10
+
+static size_t blocked, woken;
+
+static void *blocker(__attribute__((unused)) void *arg)
+{
+	enter_critical_section();
+	blocked++;
+	thread_block();
+	woken++;
+	exit_critical_section();
+
+	return NULL;
+}
+
+static void *free_blocker(__attribute__((unused)) void *arg)
+{
+	thread_block();
+	return NULL;
+}
+
+static size_t get_count(size_t *counter)
+{
+	size_t count;
+
+	enter_critical_section();
+	count = *counter;
+	exit_critical_section();
+
+	return count;
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nthreads = NTHREADS;
+
+	if (argc > 1)
+		nthreads = get_argv(argv[1]);
+
+	pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, blocker, NULL);
+	while (get_count(&blocked) < nthreads)
+		sched_yield();
+
+	assert(thread_unblock(pthread_self()) == -1);
+
+	enter_critical_section();
+	for (size_t i = nthreads; i > 0; i--) {
+		/* Each thread blocked in the critical section it counted itself in */
+		assert(thread_unblock(tids[i - 1]) == 0);
+		assert(thread_unblock(tids[i - 1]) == -1);
+	}
+	exit_critical_section();
+
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	assert(woken == nthreads);
+
+	/* Without the critical section, wait until each thread has blocked */
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, free_blocker, NULL);
+	for (size_t i = 0; i < nthreads; i++) {
+		while (thread_unblock(tids[i]) == -1)
+			sched_yield();
+		pthread_join(tids[i], NULL);
+	}
+
+	free(tids);
+	printf("thread_block: all tests passed\n");
+
+	return 0;
+}
@@ -50,6 +50,8 @@ void *thread2(__attribute__((unused)) void *arg){
 
 	// Check that modifying the clone page doesn't modify original
 	assert(tps_write(0, TPS_SIZE, msg3) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg3, TPS_SIZE));
 
 	sem_up(sem1);
 	sem_down(sem2);
@@ -106,11 +108,60 @@ void *thread1(__attribute__((unused)) void *arg){
 	assert(tps_write(0, TPS_SIZE, numbers) == 0);
 	assert(tps_read(0, TPS_SIZE, numberBuffer) == 0);
 	assert(!memcmp(numberBuffer, numbers, TPS_SIZE));
+
+	// Check that a recycled TPS area comes back zeroed
+	char zeros[TPS_SIZE] = { 0 };
+	assert(tps_reserve(4) == 0);
+	assert(tps_destroy() == 0);
+	assert(tps_destroy() == -1);
+	assert(tps_create() == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, zeros, TPS_SIZE));
+
+	// Check multi-page TPS areas: bounds, growing and shrinking
+	assert(tps_destroy() == 0);
+	assert(tps_create_sized(0) == -1);
+	assert(tps_create_sized(2 * TPS_SIZE) == 0);
+	assert(tps_write(2 * TPS_SIZE - 1, 2, msg1) == -1);
+	assert(tps_write(TPS_SIZE, TPS_SIZE, msg2) == 0);
+	assert(tps_resize(4 * TPS_SIZE) == 0);
+	assert(tps_read(TPS_SIZE, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg2, TPS_SIZE));
+	assert(tps_read(3 * TPS_SIZE, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, zeros, TPS_SIZE));
+	assert(tps_resize(TPS_SIZE) == 0);
+	assert(tps_read(TPS_SIZE, 1, buffer) == -1);
+
+	// Check vectored accesses: all segments are checked before anything moves
+	char field1[8] = "field1", field2[8] = "field2", out1[8], out2[8];
+	tps_segment_t writes[] = { { 0, 8, field1 }, { 100, 8, field2 } };
+	tps_segment_t reads[] = { { 100, 8, out2 }, { 0, 8, out1 } };
+	tps_segment_t badWrites[] = { { 0, 8, field2 }, { TPS_SIZE - 4, 8, field2 } };
+	assert(tps_writev(writes, 2) == 0);
+	assert(tps_writev(badWrites, 2) == -1);
+	assert(tps_readv(reads, 2) == 0);
+	assert(!memcmp(out1, field1, 8) && !memcmp(out2, field2, 8));
+
+	// Check in-place access: the TPS is only usable through the pointer
+	// until the session is closed
+	assert(tps_map(0) == NULL);
+	char* mapped = tps_map(TPS_MAP_WRITE);
+	assert(mapped != NULL);
+	assert(tps_map(TPS_MAP_READ) == NULL);
+	assert(tps_read(0, 8, out1) == -1);
+	assert(!memcmp(mapped + 100, field2, 8));
+	memcpy(mapped, field2, 8);
+	assert(tps_unmap() == 0);
+	assert(tps_unmap() == -1);
+	assert(tps_read(0, 8, out1) == 0);
+	assert(!memcmp(out1, field2, 8));
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
+	int mode = TPS_MODE_DEFAULT;
+
 	// If argument '1' is provided, check that thread1 can't access its TPS outside of tps_read() or tps_write
 	// If argument '2' is provided, check that thread2 can't access thread1's TPS
 	// Expected outcome is a crash
@@ -120,12 +171,16 @@ int main(int argc, char **argv)
 		else if(!strcmp(argv[1], "2"))
 			checkTPSProtection = 2;
 	}
+	// An optional second argument selects the TPS mode to test
+	if (argc > 2)
+		mode = atoi(argv[2]);
 
 	sem1 = sem_create(0);
 	sem2 = sem_create(0);
 
 	/* Init TPS API */
-	tps_init(1);
+	assert(tps_init_mode(1, mode) == 0);
+	assert(tps_init(1) == -1);
 
 	/* Create thread 1 and wait */
 	pthread_create(&tid1, NULL, thread1, NULL);